@@ -0,0 +1,524 @@
+#pragma once
+
+// awaitable loads, saves, frame reads and pipeline runs, for compilers with
+// coroutines: C++20, or C++17 with -fcoroutines (gcc) or /await:strict (msvc)
+#ifdef OPENCV_PIPELINE_COROUTINES
+
+namespace opencv_pipeline {
+
+// a fixed pool of threads that runs the work co_awaited by tasks. two are
+// shared: one sized for compute, and a larger one for blocking file and
+// capture reads, so those don't hold up computation
+class executor
+{
+  public:
+    explicit executor(unsigned threads=std::thread::hardware_concurrency())
+    {
+        for (unsigned i=0; i<std::max(threads, 1u); ++i)
+            threads_.emplace_back([this] { work(); });
+    }
+
+    ~executor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto &thread : threads_)
+            thread.join();
+    }
+
+    executor(executor const &)            = delete;
+    executor &operator=(executor const &) = delete;
+
+    void post(std::function<void ()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        ready_.notify_one();
+    }
+
+    static executor &compute()
+    {
+        static auto *const pool = new executor();
+        return *pool;
+    }
+
+    static executor &io()
+    {
+        static auto *const pool = new executor(4 * std::max(std::thread::hardware_concurrency(), 1u));
+        return *pool;
+    }
+
+  private:
+    void work()
+    {
+        while (1)
+        {
+            std::function<void ()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_  ||  !jobs_.empty(); });
+                if (jobs_.empty())
+                    return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread>           threads_;
+    std::mutex                         mutex_;
+    std::condition_variable            ready_;
+    std::deque<std::function<void ()>> jobs_;
+    bool                               stopping_ = false;
+};
+
+template<typename T=void>
+class task;
+
+namespace detail {
+
+// the state of a task shared by its promise and whoever awaits it: null
+// while it runs unawaited, the awaiting coroutine, finished, or abandoned
+// by a task object destroyed while it ran
+inline
+void *task_finished()
+{
+    static char sentinel;
+    return &sentinel;
+}
+
+inline
+void *task_abandoned()
+{
+    static char sentinel;
+    return &sentinel;
+}
+
+struct task_promise_base
+{
+    struct final_awaiter
+    {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> self) noexcept
+        {
+            auto const waiting = self.promise().state.exchange(task_finished());
+            if (waiting == task_abandoned())
+            {
+                self.destroy();
+                return std::noop_coroutine();
+            }
+            return waiting? std::coroutine_handle<>::from_address(waiting) : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() const noexcept
+    {
+        return {};
+    }
+
+    final_awaiter final_suspend() const noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        error = std::current_exception();
+    }
+
+    std::atomic<void *> state { nullptr };
+    std::exception_ptr  error;
+};
+
+template<typename T>
+struct task_promise : task_promise_base
+{
+    task<T> get_return_object();
+
+    template<typename U>
+    void return_value(U &&value)
+    {
+        result.emplace(std::forward<U>(value));
+    }
+
+    T take()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*result);
+    }
+
+    std::optional<T> result;
+};
+
+template<>
+struct task_promise<void> : task_promise_base
+{
+    task<void> get_return_object();
+
+    void return_void()
+    {
+    }
+
+    void take()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+}   // namespace detail
+
+// a coroutine producing a T. it starts when first awaited, or when start()
+// is called so that many can run at once, and may be awaited once
+// e.g. task<cv::Mat> process(std::filesystem::path in, persistent_pipeline const &p)
+//      {
+//          co_return co_await async_run(p, co_await async_load(in));
+//      }
+template<typename T>
+class task
+{
+  public:
+    using promise_type = detail::task_promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle)
+    {
+    }
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)), started_(other.started_)
+    {
+    }
+
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            handle_  = std::exchange(other.handle_, nullptr);
+            started_ = other.started_;
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        release();
+    }
+
+    // run until the task first waits, then carry on without a waiter
+    void start()
+    {
+        if (!started_)
+        {
+            started_ = true;
+            handle_.resume();
+        }
+    }
+
+    auto operator co_await() && noexcept
+    {
+        struct awaiter
+        {
+            task &t;
+
+            bool await_ready() const noexcept
+            {
+                return t.started_  &&  t.handle_.promise().state.load() == detail::task_finished();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept
+            {
+                auto &state = t.handle_.promise().state;
+                if (!t.started_)
+                {
+                    t.started_ = true;
+                    state.store(waiting.address());
+                    return t.handle_;
+                }
+
+                // a started task may finish while its waiter arrives
+                void *expected = nullptr;
+                return state.compare_exchange_strong(expected, waiting.address())? std::noop_coroutine() : waiting;
+            }
+
+            T await_resume()
+            {
+                return t.handle_.promise().take();
+            }
+        };
+        return awaiter { *this };
+    }
+
+  private:
+    void release()
+    {
+        // a started task that is still running frees itself when it finishes
+        void *running = nullptr;
+        if (handle_  &&  (!started_  ||  !handle_.promise().state.compare_exchange_strong(running, detail::task_abandoned())))
+            handle_.destroy();
+        handle_ = nullptr;
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+    bool                                started_ = false;
+};
+
+namespace detail {
+
+template<typename T>
+task<T> task_promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline
+task<void> task_promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// run a function on an executor, resuming the awaiting coroutine on the
+// executor's thread once it returns
+template<typename Fn>
+struct offload
+{
+    using result_type = std::invoke_result_t<Fn &>;
+    using stored_type = std::conditional_t<std::is_void<result_type>::value, std::monostate, result_type>;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> waiting)
+    {
+        pool->post([this, waiting] {
+            try
+            {
+                if constexpr (std::is_void<result_type>::value)
+                {
+                    fn();
+                    result.emplace();
+                }
+                else
+                    result.emplace(fn());
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            waiting.resume();
+        });
+    }
+
+    result_type await_resume()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        if constexpr (!std::is_void<result_type>::value)
+            return std::move(*result);
+    }
+
+    executor                  *pool;
+    Fn                         fn;
+    std::optional<stored_type> result;
+    std::exception_ptr         error;
+};
+
+// a coroutine that nothing awaits, which frees itself when it finishes
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        void unhandled_exception() const noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+}   // namespace detail
+
+// co_await the result of `fn`, run on an executor's thread
+template<typename Fn>
+detail::offload<Fn> async(Fn fn, executor &pool=executor::compute())
+{
+    return { &pool, std::move(fn), std::nullopt, nullptr };
+}
+
+// as pathname | load, on the io executor
+inline
+auto async_load(std::filesystem::path pathname, int flags=cv::IMREAD_COLOR)
+{
+    return async([pathname, flags] {
+        auto image = load_image(pathname, flags);
+        if (image.empty())
+            throw exceptions::file_not_found(pathname);
+        return image;
+    }, executor::io());
+}
+
+// as image | save(pathname), on the io executor
+inline
+auto async_save(cv::Mat image, std::filesystem::path pathname)
+{
+    return async([image, pathname] { return image | save(pathname); }, executor::io());
+}
+
+// the next frame of a video, read on the io executor. a video_pipeline
+// reads its frames in order, so await each read before the next
+inline
+auto async_read(video_pipeline &video)
+{
+    return async([&video] { return video.next_frame(); }, executor::io());
+}
+
+// run a persistent_pipeline on the compute executor
+inline
+auto async_run(persistent_pipeline const &pipeline, cv::Mat image)
+{
+    return async([&pipeline, image]() mutable { return pipeline(std::move(image)); });
+}
+
+// start every task, so they all make progress at once, and collect their
+// results in order
+template<typename T>
+task<std::vector<T>> when_all(std::vector<task<T>> tasks)
+{
+    for (auto &t : tasks)
+        t.start();
+
+    // every task is awaited, even after one fails, before the failure is rethrown
+    std::vector<T>     results;
+    std::exception_ptr error;
+    results.reserve(tasks.size());
+    for (auto &t : tasks)
+    {
+        try
+        {
+            results.push_back(co_await std::move(t));
+        }
+        catch (...)
+        {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+    co_return results;
+}
+
+inline
+task<> when_all(std::vector<task<>> tasks)
+{
+    for (auto &t : tasks)
+        t.start();
+
+    std::exception_ptr error;
+    for (auto &t : tasks)
+    {
+        try
+        {
+            co_await std::move(t);
+        }
+        catch (...)
+        {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+namespace detail {
+
+template<typename T>
+struct sync_state
+{
+    std::mutex                                                                  mutex;
+    std::condition_variable                                                     finished;
+    bool                                                                        done = false;
+    std::optional<std::conditional_t<std::is_void<T>::value, std::monostate, T>> result;
+    std::exception_ptr                                                          error;
+};
+
+// the state outlives the coroutine, as sync_wait waits for it
+template<typename T>
+detached run_to_completion(task<T> &t, sync_state<T> &state)
+{
+    try
+    {
+        if constexpr (std::is_void<T>::value)
+        {
+            co_await std::move(t);
+            state.result.emplace();
+        }
+        else
+            state.result.emplace(co_await std::move(t));
+    }
+    catch (...)
+    {
+        state.error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.done = true;
+    state.finished.notify_all();
+}
+
+}   // namespace detail
+
+// block the calling thread until the task finishes, and return its result
+template<typename T>
+T sync_wait(task<T> t)
+{
+    detail::sync_state<T> state;
+    detail::run_to_completion(t, state);
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.finished.wait(lock, [&state] { return state.done; });
+    if (state.error)
+        std::rethrow_exception(state.error);
+    if constexpr (!std::is_void<T>::value)
+        return std::move(*state.result);
+}
+
+}   // namespace opencv_pipeline
+
+#endif  // OPENCV_PIPELINE_COROUTINES
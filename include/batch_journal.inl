@@ -0,0 +1,360 @@
+#pragma once
+
+#include "platform.h"
+
+namespace opencv_pipeline {
+
+namespace detail {
+
+// the identity of a pipeline in a journal: the signatures of its stages,
+// which must be the same on every run. stages whose signature names the
+// address of an image they read, such as subtract(), are known by its
+// pixels instead. a stage without one, such as a lambda, is known only by
+// its position, and changing it would leave stale items journaled as done,
+// so such a pipeline needs a `version` that the caller changes along with it
+inline
+std::string pipeline_signature(persistent_pipeline const &pipeline, std::string const &version)
+{
+    std::string signature = version.empty()? std::string() : "[" + version + "] ";
+    auto const &stages = pipeline.stages();
+    for (size_t i=0; i<stages.size(); ++i)
+    {
+        if (i)
+            signature += " | ";
+        if (stages[i].signature.empty()  &&  version.empty())
+            throw std::invalid_argument("checkpointing a pipeline with unsigned stage #" + std::to_string(i) + " needs a version");
+        if (stages[i].stable_signature)
+            signature += stages[i].stable_signature();
+        else
+            signature += stages[i].signature.empty()? "#" + std::to_string(i) : stages[i].signature;
+    }
+
+    // narrowed intermediates change the results slightly
+    if (pipeline.precision() == half_precision)
+        signature += " @half_precision";
+    else if (pipeline.precision() == fixed16_precision)
+        signature += " @fixed16_precision";
+    return signature;
+}
+
+// journal fields are separated by tabs, one record to a line
+inline
+std::string escape_field(std::string const &field)
+{
+    std::string escaped;
+    for (auto const c : field)
+    {
+        switch (c)
+        {
+          case '\\': escaped += "\\\\"; break;
+          case '\t': escaped += "\\t";  break;
+          case '\n': escaped += "\\n";  break;
+          case '\r': escaped += "\\r";  break;
+          default:   escaped += c;      break;
+        }
+    }
+    return escaped;
+}
+
+inline
+std::vector<std::string> split_record(std::string const &line)
+{
+    std::vector<std::string> fields(1);
+    for (size_t i=0; i<line.size(); ++i)
+    {
+        if (line[i] == '\t')
+            fields.emplace_back();
+        else if (line[i] == '\\'  &&  i+1 < line.size())
+        {
+            switch (line[++i])
+            {
+              case 't': fields.back() += '\t'; break;
+              case 'n': fields.back() += '\n'; break;
+              case 'r': fields.back() += '\r'; break;
+              default:  fields.back() += line[i]; break;
+            }
+        }
+        else
+            fields.back() += line[i];
+    }
+    return fields;
+}
+
+// write a file and force it to disk before returning, so that a journal
+// record made after it never outlives the output it names
+inline
+bool write_durably(std::filesystem::path const &pathname, std::vector<uchar> const &bytes)
+{
+    if (bytes.empty())
+        return false;
+#ifdef _WIN32
+    auto const file = CreateFileW(pathname.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD written = 0;
+    bool const ok = WriteFile(file, bytes.data(), DWORD(bytes.size()), &written, nullptr)  &&  written == bytes.size()
+                &&  FlushFileBuffers(file);
+    CloseHandle(file);
+#else
+    auto const file = ::open(pathname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        return false;
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+        auto const n = ::write(file, bytes.data() + written, bytes.size() - written);
+        if (n < 0  &&  errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += size_t(n);
+    }
+    bool const ok = written == bytes.size()  &&  ::fsync(file) == 0;
+    ::close(file);
+#endif
+    return ok;
+}
+
+}   // namespace detail
+
+// an append-only record of the items a batch has completed, so that a run
+// interrupted by a crash or pre-emption resumes where it stopped. each
+// record names the pipeline, the input and where its output was saved.
+// records are written as items complete, but only forced to disk every
+// `sync_every` records or `sync_interval`, whichever comes first, so a
+// crash costs at most those few items being redone
+class journal
+{
+  public:
+    explicit journal(
+        std::filesystem::path     pathname,
+        size_t                    sync_every=64,
+        std::chrono::milliseconds sync_interval=std::chrono::seconds(1))
+      : pathname_(std::move(pathname)), sync_every_(std::max<size_t>(sync_every, 1)), sync_interval_(sync_interval)
+    {
+        // a record cut short by a crash has no end of line, and is ignored
+        std::ifstream existing(pathname_, std::ios::binary);
+        std::string   contents((std::istreambuf_iterator<char>(existing)), std::istreambuf_iterator<char>());
+        size_t        begin = 0;
+        for (auto end=contents.find('\n'); end != std::string::npos; begin=end+1, end=contents.find('\n', begin))
+        {
+            auto const fields = detail::split_record(contents.substr(begin, end - begin));
+            if (fields.size() == 3)
+                done_[key(fields[0], fields[1])] = fields[2];
+        }
+
+#ifdef _WIN32
+        file_ = CreateFileW(pathname_.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        bool const opened = file_ != INVALID_HANDLE_VALUE;
+#else
+        file_ = ::open(pathname_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        bool const opened = file_ >= 0;
+#endif
+        if (!opened)
+            throw std::runtime_error("Unable to open journal " + detail::utf8(pathname_));
+
+        // start a fresh line after a record that was cut short
+        if (begin < contents.size())
+            write("\n");
+        last_sync_ = clock::now();
+    }
+
+    ~journal()
+    {
+        sync();
+#ifdef _WIN32
+        CloseHandle(file_);
+#else
+        ::close(file_);
+#endif
+    }
+
+    journal(journal const &)            = delete;
+    journal &operator=(journal const &) = delete;
+
+    // the input was completed by a pipeline with this signature, and its
+    // output, if it had one, is still there and not left empty
+    bool done(std::string const &signature, std::filesystem::path const &input) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const found = done_.find(key(signature, detail::utf8(input)));
+        if (found == done_.end())
+            return false;
+        if (found->second.empty())
+            return true;
+
+        std::error_code error;
+        auto const size = std::filesystem::file_size(detail::from_utf8(found->second), error);
+        return !error  &&  size > 0;
+    }
+
+    void record(std::string const &signature, std::filesystem::path const &input, std::filesystem::path const &output)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_[key(signature, detail::utf8(input))] = detail::utf8(output);
+        write(detail::escape_field(signature) + '\t'
+            + detail::escape_field(detail::utf8(input)) + '\t'
+            + detail::escape_field(detail::utf8(output)) + '\n');
+
+        if (++pending_ >= sync_every_  ||  clock::now() - last_sync_ >= sync_interval_)
+            flush();
+    }
+
+    // force the records written so far to disk
+    void sync()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return done_.size();
+    }
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    static std::string key(std::string const &signature, std::string const &input)
+    {
+        return signature + '\t' + input;
+    }
+
+    void write(std::string const &text)
+    {
+#ifdef _WIN32
+        DWORD written = 0;
+        bool const ok = WriteFile(file_, text.data(), DWORD(text.size()), &written, nullptr)  &&  written == text.size();
+#else
+        size_t written = 0;
+        while (written < text.size())
+        {
+            auto const n = ::write(file_, text.data() + written, text.size() - written);
+            if (n < 0  &&  errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            written += size_t(n);
+        }
+        bool const ok = written == text.size();
+#endif
+        if (!ok)
+            throw std::runtime_error("Unable to write journal " + detail::utf8(pathname_));
+    }
+
+    void flush()
+    {
+        if (pending_ == 0)
+            return;
+#ifdef _WIN32
+        FlushFileBuffers(file_);
+#else
+        ::fsync(file_);
+#endif
+        pending_   = 0;
+        last_sync_ = clock::now();
+    }
+
+    std::filesystem::path const                   pathname_;
+    size_t const                                  sync_every_;
+    std::chrono::milliseconds const               sync_interval_;
+    mutable std::mutex                            mutex_;
+    std::unordered_map<std::string, std::string>  done_;    // input and signature to output
+    size_t                                        pending_ = 0;
+    clock::time_point                             last_sync_;
+#ifdef _WIN32
+    HANDLE                                        file_ = INVALID_HANDLE_VALUE;
+#else
+    int                                           file_ = -1;
+#endif
+};
+
+namespace detail {
+
+struct checkpoint_t
+{
+    journal                                                         *log;
+    persistent_pipeline                                              pipeline;
+    std::function<std::filesystem::path (std::filesystem::path const &)> output;
+    std::string                                                      signature;
+};
+
+template<typename It>
+batch_stats run_checkpointed(It first, It last, checkpoint_t const &run)
+{
+    batch_stats stats;
+    auto const &signature = run.signature;
+    for (; first != last; ++first)
+    {
+        std::filesystem::path const input = *first;
+        if (run.log->done(signature, input))
+        {
+            ++stats.items;
+            ++stats.skipped;
+            continue;
+        }
+
+        auto item = try_item(input, run.pipeline);
+        std::filesystem::path output;
+        if (item.status == item_ok  &&  run.output)
+        {
+            // the output is on disk before the record naming it is written
+            output = run.output(input);
+            try
+            {
+                std::vector<uchar> encoded;
+                if (!cv::imencode(detail::utf8(output.extension()), item.result, encoded)  ||  !write_durably(output, encoded))
+                    item.status = item_stage_failed;
+            }
+            catch (std::exception const &)
+            {
+                item.status = item_stage_failed;
+            }
+        }
+
+        // failed items aren't journaled, so a rerun tries them again
+        count_item(stats, item.status);
+        if (item.status == item_ok)
+            run.log->record(signature, input, output);
+    }
+    run.log->sync();
+    return stats;
+}
+
+}   // namespace detail
+
+// run a pipeline over a batch of files, skipping those the journal shows
+// this pipeline already completed, and journaling each one it completes.
+// results are saved where `output` names for each input; without it, the
+// pipeline is expected to save them itself. failures are counted as by
+// try_each and don't stop the batch. a pipeline with stages that have no
+// signature, such as lambdas, is identified by `version` instead, which
+// must be changed whenever those stages are; without one it is refused
+// e.g. journal log("run.journal");
+//      walk("in/**/*.png") | checkpoint(log, pipeline | gray, [](auto const &in) { return "out" / in.filename(); });
+inline
+detail::checkpoint_t
+checkpoint(
+    journal                                                             &log,
+    persistent_pipeline                                                  pipeline,
+    std::function<std::filesystem::path (std::filesystem::path const &)> output=nullptr,
+    std::string const                                                   &version=std::string())
+{
+    auto signature = detail::pipeline_signature(pipeline, version);
+    return { &log, std::move(pipeline), std::move(output), std::move(signature) };
+}
+
+inline
+batch_stats operator|(std::vector<std::filesystem::path> const &files, detail::checkpoint_t const &run)
+{
+    return detail::run_checkpointed(files.begin(), files.end(), run);
+}
+
+inline
+batch_stats operator|(walk const &files, detail::checkpoint_t const &run)
+{
+    return detail::run_checkpointed(files.begin(), files.end(), run);
+}
+
+}   // namespace opencv_pipeline
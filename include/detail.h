@@ -10,16 +10,119 @@ namespace detail {
 
 // manuipulation
 cv::Mat color_space(cv::Mat const &image, int code);
+cv::Mat crop(cv::Mat const &image, cv::Rect rect);
 cv::Mat convert(cv::Mat const &image, int type, double alpha=1.0, double beta=0.0);
-cv::Mat dilate(cv::Mat const &image, int dx, int dy);
-cv::Mat erode(cv::Mat const &image, int dx, int dy);
+cv::Mat dilate(cv::Mat const &image, cv::Mat const &kernel, int shape);
+cv::Mat erode(cv::Mat const &image, cv::Mat const &kernel, int shape);
 cv::Mat gaussian_blur(cv::Mat const &image, int dx, int dy, double sigmaX, double sigmaY, int border);
+cv::Mat lut(cv::Mat const &image, cv::Mat const &table);
 cv::Mat sobel(cv::Mat const &image, int dx, int dy, int ksize, double scale, double delta, int border);
 cv::Mat subtract(cv::Mat const &image1, cv::Mat const &image2);
 cv::Mat threshold(cv::Mat const &image, double thresh, double maxval, int type);
 
+// in place execution
+bool sole_owner(cv::Mat const &image);
+bool convert_inplace(cv::Mat &image, int type, double alpha, double beta);
+struct builtin_stage
+{
+    cv::Mat  (*fn)(cv::Mat const &);
+    char const *name;
+    bool        pointwise;
+    bool     (*inplace)(cv::Mat &);
+    std::vector<pointwise_op> ops;
+};
+builtin_stage const *find_builtin(cv::Mat (*fn)(cv::Mat const &));
+pipeline_stage make_stage(cv::Mat (*fn)(cv::Mat const &));
+
+// fused pointwise stages
+bool run_fused(cv::Mat &image, std::vector<pointwise_op const *> const &ops);
+
+// reduced precision intermediates
+struct narrow_image
+{
+    cv::Mat                data;        // 16 bits a value
+    int                    type;        // of the image narrowed
+    intermediate_precision precision;
+    std::vector<double>    row_scale;   // fixed16_precision: of each row
+};
+bool narrowable(cv::Mat const &image);
+narrow_image narrow_buffer(int rows, int cols, int type, intermediate_precision precision);
+void narrow_rows(cv::Mat const &rows, narrow_image &image, int first);
+narrow_image narrow(cv::Mat const &image, intermediate_precision precision);
+cv::Mat widen(narrow_image const &image, int first, int last);
+int band_rows(narrow_image const &image, int halo);
+
+// stage footprints
+cv::Rect bounds(cv::Mat const &image);
+cv::Rect grow(cv::Rect const &rect, cv::Size margin);
+cv::Size color_space_halo(int code);
+cv::Size gaussian_halo(int dx, int dy, double sigmaX, double sigmaY);
+cv::Size kernel_halo(int dx, int dy);
+
+// external memory
+cv::Mat external_mat(cv::Mat const &view, std::function<void ()> release);
+
+// image pyramids
+pyramid_image build_pyramid(cv::Mat const &image, int levels, double scale);
+cv::Mat pyramid_level(pyramid_image const &pyramid, cv::Size size);
+
+// stage identity
+template<typename... Args>
+std::string signature(char const *name, Args const &...args);
+uint64_t pixel_hash(cv::Mat const &image);
+
+// allocation accounting
+struct allocation_counts
+{
+    size_t allocations;
+    size_t bytes;
+    size_t live_bytes;
+    size_t peak_bytes;  // since the last reset_allocation_peak()
+};
+void account_allocations(bool enable);
+allocation_counts allocations();
+void reset_allocation_peak();
+
+#if CV_MAJOR_VERSION!=2
+
+// an allocator installed over cv::Mat's default, delegating to whichever
+// was the default when it was installed. the installed ones form a single
+// stack, and one uninstalled from the middle hands its delegate to the one
+// above it, so they nest with each other in any order
+class stacked_allocator : public cv::MatAllocator
+{
+  public:
+#if CV_MAJOR_VERSION >= 4
+    using access_flags = cv::AccessFlag;
+#else
+    using access_flags = int;
+#endif
+
+    void install(bool enable);
+
+  protected:
+    cv::MatAllocator *inner() const
+    {
+        return inner_;
+    }
+
+  private:
+    static std::mutex &mutex();
+    static std::vector<stacked_allocator *> &installed();
+
+    std::atomic<cv::MatAllocator *> inner_{cv::Mat::getDefaultAllocator()};
+    size_t                          installs_ = 0;
+};
+
+#endif
+
 // conditions
+struct change_gate;
 cv::Mat if_(cv::Mat const &image, std::function<bool const (cv::Mat const &)> cond, pipeline_fn_t fn);
+cv::Mat if_else(cv::Mat const &image, std::function<bool const (cv::Mat const &)> cond, pipeline_fn_t fn, pipeline_fn_t else_fn);
+cv::Mat change_signature(cv::Mat const &image);
+bool changed(cv::Mat const &image, change_gate &gate);
+cv::Mat if_changed(cv::Mat const &image, pipeline_fn_t const &fn, std::shared_ptr<change_gate> gate);
 
 // attributes
 bool const channels(cv::Mat const &image, int num);
@@ -27,11 +130,23 @@ bool const channels(cv::Mat const &image, int num);
 std::vector<cv::KeyPoint>
 to_keypoints(std::vector<std::vector<cv::Point>> const &regions);
 
+std::vector<size_t>
+limit_indices(std::vector<cv::KeyPoint> const &keypoints, size_t count, cv::Size grid, bool anms);
+
+std::vector<cv::KeyPoint>
+limit_keypoints(std::vector<cv::KeyPoint> const &keypoints, size_t count, cv::Size grid, bool anms);
+
 cv::Mat detect_keypoints(
     std::string         const &detector,
     std::vector<cv::KeyPoint> &keypoints,
     cv::Mat             const &image);
 
+void detect_keypoints(
+    std::string         const &detector_class,
+    std::vector<cv::KeyPoint> &keypoints,
+    std::vector<int>          &levels,
+    pyramid_image       const &pyramid);
+
 cv::Mat detect_regions(
     std::string                   const &detector_class,
     std::vector<std::vector<cv::Point>> &regions,
@@ -42,6 +157,19 @@ cv::Mat extract_keypoints(
     std::vector<cv::KeyPoint> const &keypoints,
     cv::Mat                   const &image);
 
+cv::Mat extract_keypoints(
+    std::string                      extractor_class,
+    std::vector<cv::KeyPoint> const &keypoints,
+    std::vector<int>          const &levels,
+    pyramid_image             const &pyramid);
+
+bool detect_and_extract(
+    std::string         const &detector_class,
+    std::string         const &extractor_class,
+    std::vector<cv::KeyPoint> &keypoints,
+    cv::Mat                   &descriptors,
+    cv::Mat             const &image);
+
 cv::Mat extract_regions(
     std::string                                extractor_class,
     std::vector<std::vector<cv::Point>> const &regions,
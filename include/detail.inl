@@ -16,6 +16,12 @@ cv::Mat color_space(cv::Mat const &image, int code)
     return dst;
 }
 
+inline
+cv::Mat crop(cv::Mat const &image, cv::Rect rect)
+{
+    return image(rect & bounds(image));
+}
+
 inline
 cv::Mat convert(cv::Mat const &image, int type, double alpha, double beta)
 {
@@ -27,22 +33,137 @@ cv::Mat convert(cv::Mat const &image, int type, double alpha, double beta)
     return dst;
 }
 
+// rectangles at least this long on a side are filtered by van Herk/Gil-Werman
+// passes. smaller ones are faster with cv::dilate and cv::erode, whose cost
+// grows with the size of the rectangle
+int const van_herk_size = 15;
+
+// the maximum (dilate) or minimum (erode) of each column over a window of
+// `k` rows centred as cv::dilate centres its kernel. by van Herk/Gil-Werman
+// this takes three comparisons per value whatever the size of the window:
+// the window over output rows [block, block+k) is split into the suffix
+// of one block of k rows and the prefix of the next. rows beyond the image
+// count as `identity`, as the default border of cv::dilate and cv::erode.
+// each comparison is a loop along a row, which the compiler vectorises
+template<typename T, typename Op>
+void van_herk_columns(cv::Mat const &src, cv::Mat &dst, int k, Op op, T identity)
+{
+    auto const rows   = src.rows;
+    auto const n      = size_t(src.cols) * src.channels();
+    auto const anchor = k / 2;
+
+    std::vector<T> border(n, identity);
+    std::vector<T> suffix(n * k);
+    std::vector<T> prefix(n);
+    auto const padded = [&](int i) -> T const * {
+        auto const y = i - anchor;
+        return (y >= 0  &&  y < rows)? src.ptr<T>(y) : border.data();
+    };
+
+    for (int block=0; block<rows; block+=k)
+    {
+        auto const h = [&](int j) { return suffix.data() + n*j; };
+        std::copy(padded(block+k-1), padded(block+k-1) + n, h(k-1));
+        for (int j=k-2; j>=0; --j)
+        {
+            auto const p = padded(block+j);
+            auto const s = h(j+1);
+            auto const d = h(j);
+            for (size_t x=0; x<n; ++x)
+                d[x] = op(p[x], s[x]);
+        }
+
+        std::copy(h(0), h(0) + n, dst.ptr<T>(block));
+        for (int j=1; j<k  &&  block+j<rows; ++j)
+        {
+            auto const p = padded(block+k+j-1);
+            if (j == 1)
+                std::copy(p, p + n, prefix.data());
+            else
+            {
+                for (size_t x=0; x<n; ++x)
+                    prefix[x] = op(prefix[x], p[x]);
+            }
+
+            auto const s = h(j);
+            auto const d = dst.ptr<T>(block+j);
+            for (size_t x=0; x<n; ++x)
+                d[x] = op(s[x], prefix[x]);
+        }
+    }
+}
+
+// separable rectangular morphology: the columns, then the rows as the
+// columns of the transpose. a view into a larger image, such as a crop
+// moved upstream, is first widened with the pixels around it that the
+// window reaches, as cv::dilate and cv::erode read them, so only what lies
+// beyond the whole image counts as the identity
+template<typename T, typename Op>
+cv::Mat van_herk(cv::Mat const &image, cv::Size ksize, Op op, T identity)
+{
+    auto wide = image;
+    wide.adjustROI(ksize.height / 2, ksize.height - 1 - ksize.height / 2, ksize.width / 2, ksize.width - 1 - ksize.width / 2);
+    cv::Size  whole;
+    cv::Point inner, outer;
+    image.locateROI(whole, inner);
+    wide.locateROI(whole, outer);
+
+    cv::Mat columns(wide.size(), wide.type());
+    van_herk_columns<T>(wide, columns, ksize.height, op, identity);
+
+    cv::Mat transposed, filtered, dst;
+    cv::transpose(columns, transposed);
+    filtered.create(transposed.size(), transposed.type());
+    van_herk_columns<T>(transposed, filtered, ksize.width, op, identity);
+    cv::transpose(filtered, dst);
+    if (wide.size() == image.size())
+        return dst;
+    return dst(cv::Rect(inner - outer, image.size())).clone();
+}
+
+template<typename T>
+cv::Mat van_herk(cv::Mat const &image, cv::Size ksize, bool dilating)
+{
+    if (dilating)
+        return van_herk<T>(image, ksize, [](T a, T b) { return std::max(a, b); }, std::numeric_limits<T>::lowest());
+    return van_herk<T>(image, ksize, [](T a, T b) { return std::min(a, b); }, std::numeric_limits<T>::max());
+}
+
+// a large rectangle, or else the structuring element built by the stage
 inline
-cv::Mat dilate(cv::Mat const &image, int dx, int dy)
+cv::Mat morphology(cv::Mat const &image, cv::Mat const &kernel, int shape, bool dilating)
 {
+    if (shape == cv::MORPH_RECT  &&  image.dims <= 2  &&  !image.empty()
+    &&  std::max(kernel.cols, kernel.rows) >= van_herk_size)
+    {
+        switch (image.depth())
+        {
+          case CV_8U:  return van_herk<uchar>(image, kernel.size(), dilating);
+          case CV_16U: return van_herk<ushort>(image, kernel.size(), dilating);
+          case CV_16S: return van_herk<short>(image, kernel.size(), dilating);
+          case CV_32F: return van_herk<float>(image, kernel.size(), dilating);
+          default:     break;
+        }
+    }
+
     cv::Mat dst;
-    cv::Mat kernel = getStructuringElement(cv::MORPH_RECT, cv::Size(dx, dy));
-    dilate(image, dst, kernel);
+    if (dilating)
+        cv::dilate(image, dst, kernel);
+    else
+        cv::erode(image, dst, kernel);
     return dst;
 }
 
 inline
-cv::Mat erode(cv::Mat const &image, int dx, int dy)
+cv::Mat dilate(cv::Mat const &image, cv::Mat const &kernel, int shape)
 {
-    cv::Mat dst;
-    cv::Mat kernel = getStructuringElement(cv::MORPH_RECT, cv::Size(dx, dy));
-    erode(image, dst, kernel);
-    return dst;
+    return morphology(image, kernel, shape, true);
+}
+
+inline
+cv::Mat erode(cv::Mat const &image, cv::Mat const &kernel, int shape)
+{
+    return morphology(image, kernel, shape, false);
 }
 
 inline
@@ -62,6 +183,14 @@ cv::Mat gaussian_blur(cv::Mat const &image, int dx, int dy, double sigmaX, doubl
     return dst;
 }
 
+inline
+cv::Mat lut(cv::Mat const &image, cv::Mat const &table)
+{
+    cv::Mat dst;
+    cv::LUT(image, table, dst);
+    return dst;
+}
+
 inline
 cv::Mat sobel(cv::Mat const &image, int dx, int dy, int ksize, double scale, double delta, int border)
 {
@@ -91,6 +220,875 @@ cv::Mat threshold(cv::Mat const &image, double thresh, double maxval, int type)
 }
 
 
+//
+// in place execution
+//
+
+// no other Mat, UMat or user buffer refers to the image's pixels
+inline
+bool sole_owner(cv::Mat const &image)
+{
+#if CV_MAJOR_VERSION==2
+    return image.refcount != nullptr  &&  *image.refcount == 1;
+#else
+    return image.u != nullptr
+       &&  image.u->refcount == 1
+       &&  image.u->urefcount == 0
+       &&  (image.u->flags & cv::UMatData::USER_ALLOCATED) == 0;
+#endif
+}
+
+// a conversion between element types of the same size can overwrite its
+// input, converting through a header of the new type over the same pixels
+inline
+bool convert_inplace(cv::Mat &image, int type, double alpha, double beta)
+{
+    if (image.type() == type)
+        return true;    // as detail::convert, a no-op
+
+    // convertTo keeps the number of channels
+    auto const dst_type = CV_MAKETYPE(CV_MAT_DEPTH(type), image.channels());
+    if (image.dims > 2  ||  size_t(CV_ELEM_SIZE(dst_type)) != image.elemSize())
+        return false;
+
+    cv::Mat dst(image.rows, image.cols, dst_type, image.data, image.step);
+    image.convertTo(dst, dst_type, alpha, beta);
+    image.flags = (image.flags & ~CV_MAT_TYPE_MASK) | dst_type;
+    return true;
+}
+
+
+//
+// fused pointwise stages
+//
+
+// the depths whose values a float holds exactly
+inline
+bool fusible_depth(int depth)
+{
+    return depth == CV_8U  ||  depth == CV_8S  ||  depth == CV_16U  ||  depth == CV_16S  ||  depth == CV_32F;
+}
+
+// a pointwise operation, resolved for the type of the values it is given
+struct fused_step
+{
+    pointwise_op const *op;
+    int                 depth;      // of its result
+    int                 channels;
+    float               alpha;      // convert
+    float               beta;
+    float               thresh;     // threshold
+    float               maxval;
+    bool                otsu;       // thresh is still to be computed
+    cv::Mat             table;      // lut, as floats
+};
+
+// resolve each operation for the type of its input. fails when one is not
+// reproduced exactly by the fused pass, so the stages run one at a time
+inline
+bool plan_fused(cv::Mat const &image, std::vector<pointwise_op const *> const &ops, std::vector<fused_step> &steps)
+{
+    auto depth    = image.depth();
+    auto channels = image.channels();
+    if (image.dims > 2  ||  !fusible_depth(depth))
+        return false;
+
+    for (auto const op : ops)
+    {
+        fused_step step = { op, depth, channels, 1.f, 0.f, 0.f, 0.f, false, cv::Mat() };
+        switch (op->kind)
+        {
+          case pointwise_op::bgr2gray:
+          case pointwise_op::gray2bgr:
+            if (channels != (op->kind == pointwise_op::bgr2gray? 3 : 1)
+            ||  (depth != CV_8U  &&  depth != CV_16U  &&  depth != CV_32F))
+                return false;
+            step.channels = 4 - channels;
+            break;
+
+          case pointwise_op::convert:
+            if (op->type == CV_MAKETYPE(depth, channels))
+                continue;   // as detail::convert, a no-op
+            step.depth = CV_MAT_DEPTH(op->type);
+            step.alpha = float(op->alpha);
+            step.beta  = float(op->beta);
+            break;
+
+          case pointwise_op::subtract:
+            if (op->operand.dims > 2  ||  op->operand.size() != image.size()  ||  op->operand.type() != CV_MAKETYPE(depth, channels))
+                return false;
+            break;
+
+          case pointwise_op::abs:
+            break;
+
+          case pointwise_op::threshold:
+          {
+            // cv::threshold rounds the threshold and maximum of integer images
+            auto const type = op->type & cv::THRESH_MASK;
+            step.otsu = (op->type & cv::THRESH_OTSU) != 0;
+            if (type > cv::THRESH_TOZERO_INV  ||  (op->type & cv::THRESH_TRIANGLE) != 0
+            ||  (depth != CV_8U  &&  depth != CV_16S  &&  depth != CV_32F)
+            ||  (step.otsu  &&  (depth != CV_8U  ||  channels != 1)))
+                return false;
+            step.thresh = depth == CV_32F? float(op->alpha) : float(std::min(std::max(std::floor(op->alpha), -65536.), 65536.));
+            step.maxval = depth == CV_32F? float(op->beta)
+                        : depth == CV_8U?  float(cv::saturate_cast<uchar>(op->beta))
+                        :                  float(cv::saturate_cast<short>(op->beta));
+            break;
+          }
+
+          case pointwise_op::lut:
+            if (depth != CV_8U  ||  op->operand.total() != 256  ||  op->operand.channels() != 1  ||  !fusible_depth(op->operand.depth()))
+                return false;
+            step.depth = op->operand.depth();
+            op->operand.reshape(1, 1).convertTo(step.table, CV_32F);
+            break;
+        }
+
+        if (!fusible_depth(step.depth))
+            return false;
+        steps.push_back(std::move(step));
+        depth    = step.depth;
+        channels = step.channels;
+    }
+    return true;
+}
+
+template<typename T>
+void load_row(void const *src, float *row, int n)
+{
+    auto const values = static_cast<T const *>(src);
+    for (int i=0; i<n; ++i)
+        row[i] = float(values[i]);
+}
+
+inline
+void load_row(int depth, void const *src, float *row, int n)
+{
+    switch (depth)
+    {
+      case CV_8U:  load_row<uchar>(src, row, n);  break;
+      case CV_8S:  load_row<schar>(src, row, n);  break;
+      case CV_16U: load_row<ushort>(src, row, n); break;
+      case CV_16S: load_row<short>(src, row, n);  break;
+      default:     load_row<float>(src, row, n);  break;
+    }
+}
+
+// the values are already those of the depth, so storing is a plain cast
+template<typename T>
+void store_row(float const *row, void *dst, int n)
+{
+    auto const values = static_cast<T *>(dst);
+    for (int i=0; i<n; ++i)
+        values[i] = T(row[i]);
+}
+
+inline
+void store_row(int depth, float const *row, void *dst, int n)
+{
+    switch (depth)
+    {
+      case CV_8U:  store_row<uchar>(row, dst, n);  break;
+      case CV_8S:  store_row<schar>(row, dst, n);  break;
+      case CV_16U: store_row<ushort>(row, dst, n); break;
+      case CV_16S: store_row<short>(row, dst, n);  break;
+      default:     store_row<float>(row, dst, n);  break;
+    }
+}
+
+// round and clamp each value to the depth, exactly as saturate_cast
+template<typename T>
+void saturate_row(float *row, int n)
+{
+    for (int i=0; i<n; ++i)
+        row[i] = float(cv::saturate_cast<T>(row[i]));
+}
+
+inline
+void saturate_row(int depth, float *row, int n)
+{
+    switch (depth)
+    {
+      case CV_8U:  saturate_row<uchar>(row, n);  break;
+      case CV_8S:  saturate_row<schar>(row, n);  break;
+      case CV_16U: saturate_row<ushort>(row, n); break;
+      case CV_16S: saturate_row<short>(row, n);  break;
+      default:     break;
+    }
+}
+
+inline
+void threshold_row(fused_step const &step, float *row, int n)
+{
+    auto const t = step.thresh;
+    auto const m = step.maxval;
+    switch (step.op->type & cv::THRESH_MASK)
+    {
+      case cv::THRESH_BINARY:     for (int i=0; i<n; ++i) row[i] = row[i] > t? m : 0.f;      break;
+      case cv::THRESH_BINARY_INV: for (int i=0; i<n; ++i) row[i] = row[i] > t? 0.f : m;      break;
+      case cv::THRESH_TRUNC:      for (int i=0; i<n; ++i) row[i] = row[i] > t? t : row[i];   break;
+      case cv::THRESH_TOZERO:     for (int i=0; i<n; ++i) row[i] = row[i] > t? row[i] : 0.f; break;
+      default:                    for (int i=0; i<n; ++i) row[i] = row[i] > t? 0.f : row[i]; break;
+    }
+}
+
+// run the first `count` steps over `rows` of the image, a row at a time
+// through buffers that stay in cache, and either store the results in
+// dst or count them into a histogram of 8-bit values
+inline
+void fused_rows(
+    cv::Mat                 const &src,
+    cv::Mat                       &dst,
+    std::vector<fused_step> const &steps,
+    size_t                         count,
+    cv::Range                      rows,
+    int                           *histogram)
+{
+    auto const width = src.cols;
+    auto widest = src.channels();
+    for (auto const &step : steps)
+        widest = std::max(widest, step.channels);
+
+    std::vector<float> buffers[3];
+    for (auto &buffer : buffers)
+        buffer.resize(size_t(width) * widest);
+
+    // cv::cvtColor's BT.601 weights for blue, green and red. integers are
+    // weighted in fixed point and rounded, with the 15 fractional bits of
+    // current OpenCV or the 14 of OpenCV 2
+#if CV_MAJOR_VERSION < 3
+    int const gray_shift = 14, gray_b = 1868, gray_g = 9617,  gray_r = 4899;
+#else
+    int const gray_shift = 15, gray_b = 3735, gray_g = 19235, gray_r = 9798;
+#endif
+
+    for (auto y=rows.start; y<rows.end; ++y)
+    {
+        auto row      = buffers[0].data();
+        auto other    = buffers[1].data();
+        auto channels = src.channels();
+        load_row(src.depth(), src.ptr(y), row, width * channels);
+
+        for (size_t i=0; i<count; ++i)
+        {
+            auto const &step = steps[i];
+            auto const  n    = width * step.channels;
+            switch (step.op->kind)
+            {
+              case pointwise_op::bgr2gray:
+                if (step.depth == CV_32F)
+                {
+                    for (int x=0; x<width; ++x)
+                        other[x] = row[3*x]*0.114f + row[3*x+1]*0.587f + row[3*x+2]*0.299f;
+                }
+                else
+                {
+                    for (int x=0; x<width; ++x)
+                        other[x] = float((int(row[3*x])*gray_b + int(row[3*x+1])*gray_g + int(row[3*x+2])*gray_r + (1 << (gray_shift - 1))) >> gray_shift);
+                }
+                std::swap(row, other);
+                break;
+
+              case pointwise_op::gray2bgr:
+                for (int x=0; x<width; ++x)
+                    other[3*x] = other[3*x+1] = other[3*x+2] = row[x];
+                std::swap(row, other);
+                break;
+
+              case pointwise_op::convert:
+                for (int j=0; j<n; ++j)
+                    row[j] = row[j]*step.alpha + step.beta;
+                break;
+
+              case pointwise_op::subtract:
+              {
+                auto const operand = buffers[2].data();
+                load_row(step.depth, step.op->operand.ptr(y), operand, n);
+                for (int j=0; j<n; ++j)
+                    row[j] -= operand[j];
+                break;
+              }
+
+              case pointwise_op::abs:
+                for (int j=0; j<n; ++j)
+                    row[j] = std::abs(row[j]);
+                break;
+
+              case pointwise_op::threshold:
+                threshold_row(step, row, n);
+                break;
+
+              case pointwise_op::lut:
+              {
+                auto const table = step.table.ptr<float>();
+                for (int j=0; j<n; ++j)
+                    row[j] = table[int(row[j])];
+                break;
+              }
+            }
+            saturate_row(step.depth, row, n);
+            channels = step.channels;
+        }
+
+        if (histogram)
+        {
+            for (int x=0; x<width; ++x)
+                ++histogram[int(row[x])];
+        }
+        else
+            store_row(dst.depth(), row, dst.ptr(y), width * channels);
+    }
+}
+
+// Otsu's threshold of an 8-bit histogram, as cv::threshold computes it
+inline
+double otsu_threshold(std::array<int, 256> const &histogram)
+{
+    double total = 0., mu = 0.;
+    for (int i=0; i<256; ++i)
+    {
+        total += histogram[i];
+        mu    += i * double(histogram[i]);
+    }
+    if (total == 0.)
+        return 0.;
+
+    auto const scale   = 1. / total;
+    auto const epsilon = double(std::numeric_limits<float>::epsilon());
+    double mu1 = 0., q1 = 0., max_sigma = 0., max_val = 0.;
+    mu *= scale;
+    for (int i=0; i<256; ++i)
+    {
+        auto const p_i = histogram[i] * scale;
+        mu1 *= q1;
+        q1  += p_i;
+        auto const q2 = 1. - q1;
+        if (std::min(q1, q2) < epsilon  ||  std::max(q1, q2) > 1. - epsilon)
+            continue;
+
+        mu1 = (mu1 + i*p_i) / q1;
+        auto const mu2   = (mu - q1*mu1) / q2;
+        auto const sigma = q1*q2*(mu1 - mu2)*(mu1 - mu2);
+        if (sigma > max_sigma)
+        {
+            max_sigma = sigma;
+            max_val   = i;
+        }
+    }
+    return max_val;
+}
+
+// run a chain of pointwise operations as one pass over the image instead
+// of a pass, and an intermediate image, per operation. an Otsu threshold
+// first needs the histogram of its input, which a pass over the image
+// computes without storing anything. replaces the image with the result,
+// or returns false if the chain can't be fused for the image's type
+inline
+bool run_fused(cv::Mat &image, std::vector<pointwise_op const *> const &ops)
+{
+    std::vector<fused_step> steps;
+    if (!plan_fused(image, ops, steps))
+        return false;
+    if (steps.empty())
+        return true;
+
+    for (size_t k=0; k<steps.size(); ++k)
+    {
+        if (!steps[k].otsu)
+            continue;
+
+        std::array<int, 256> histogram = {};
+        std::mutex mutex;
+        cv::parallel_for_(cv::Range(0, image.rows), [&](cv::Range const &rows) {
+            std::array<int, 256> part = {};
+            fused_rows(image, image, steps, k, rows, part.data());
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i=0; i<part.size(); ++i)
+                histogram[i] += part[i];
+        });
+        steps[k].thresh = float(otsu_threshold(histogram));
+        steps[k].otsu   = false;
+    }
+
+    // each row is read whole before its result is written, so an image of
+    // the result's type that nothing else refers to is overwritten
+    auto const type = CV_MAKETYPE(steps.back().depth, steps.back().channels);
+    cv::Mat dst = (image.type() == type  &&  sole_owner(image))? image : cv::Mat(image.size(), type);
+    cv::parallel_for_(cv::Range(0, image.rows), [&](cv::Range const &rows) {
+        fused_rows(image, dst, steps, steps.size(), rows, nullptr);
+    });
+    image = dst;
+    return true;
+}
+
+
+//
+// reduced precision intermediates
+//
+
+// floating point images are narrowed; others are already compact
+inline
+bool narrowable(cv::Mat const &image)
+{
+    return image.dims == 2  &&  (image.depth() == CV_32F  ||  image.depth() == CV_64F);
+}
+
+// half floats are CV_16F where OpenCV has it, or else the CV_16S bits of
+// cv::convertFp16
+inline
+narrow_image narrow_buffer(int rows, int cols, int type, intermediate_precision precision)
+{
+    narrow_image image;
+#ifdef CV_16F
+    auto const depth = precision == half_precision? CV_16F : CV_16S;
+#else
+    auto const depth = CV_16S;
+#endif
+    image.data.create(rows, cols, CV_MAKETYPE(depth, CV_MAT_CN(type)));
+    image.type      = type;
+    image.precision = precision;
+    if (precision == fixed16_precision)
+        image.row_scale.assign(size_t(rows), 1.);
+    return image;
+}
+
+// store `rows` as the rows of the image from `first`. a half float is
+// within 2^-11 of a value's magnitude up to 65504, beyond which it is
+// infinite. fixed16 scales each row so its largest finite magnitude is
+// 32767, which is within 1/65534 of that magnitude
+inline
+void narrow_rows(cv::Mat const &rows, narrow_image &image, int first)
+{
+    auto dst = image.data.rowRange(first, first + rows.rows);
+    if (image.precision == half_precision)
+    {
+#ifdef CV_16F
+        rows.convertTo(dst, CV_16F);
+#else
+        cv::Mat single = rows;
+        if (rows.depth() != CV_32F)
+            rows.convertTo(single, CV_32F);
+        cv::convertFp16(single, dst);
+#endif
+        return;
+    }
+
+    for (int y=0; y<rows.rows; ++y)
+    {
+        auto const peak  = cv::norm(rows.row(y), cv::NORM_INF);
+        auto const scale = peak > 0.  &&  peak <= std::numeric_limits<double>::max()? 32767. / peak : 1.;
+        auto row = dst.row(y);
+        rows.row(y).convertTo(row, CV_16S, scale);
+        image.row_scale[size_t(first + y)] = scale;
+    }
+}
+
+inline
+narrow_image narrow(cv::Mat const &image, intermediate_precision precision)
+{
+    auto narrowed = narrow_buffer(image.rows, image.cols, image.type(), precision);
+    narrow_rows(image, narrowed, 0);
+    return narrowed;
+}
+
+// rows [first, last) of the image at the precision it was narrowed from
+inline
+cv::Mat widen(narrow_image const &image, int first, int last)
+{
+    cv::Mat wide;
+    auto const rows = image.data.rowRange(first, last);
+    if (image.precision == half_precision)
+    {
+#ifdef CV_16F
+        rows.convertTo(wide, image.type);
+#else
+        cv::convertFp16(rows, wide);
+        if (CV_MAT_DEPTH(image.type) != CV_32F)
+            wide.convertTo(wide, image.type);
+#endif
+        return wide;
+    }
+
+    wide.create(last - first, image.data.cols, image.type);
+    for (int y=first; y<last; ++y)
+    {
+        auto row = wide.row(y - first);
+        image.data.row(y).convertTo(row, image.type, 1. / image.row_scale[size_t(y)]);
+    }
+    return wide;
+}
+
+// the rows of a band widened at a time: enough to fill around 256KB, which
+// stays in a core's cache, and plenty more than the rows its halo repeats
+inline
+int band_rows(narrow_image const &image, int halo)
+{
+    auto const row_bytes = std::max<size_t>(size_t(image.data.cols) * CV_ELEM_SIZE(image.type), 1);
+    return std::max({ int((size_t(256) << 10) / row_bytes), 4 * halo, 16 });
+}
+
+
+//
+// stage footprints
+//
+
+inline
+cv::Rect bounds(cv::Mat const &image)
+{
+    return cv::Rect(cv::Point(), image.size());
+}
+
+inline
+cv::Rect grow(cv::Rect const &rect, cv::Size margin)
+{
+    return cv::Rect(
+        rect.x - margin.width,
+        rect.y - margin.height,
+        rect.width  + 2 * margin.width,
+        rect.height + 2 * margin.height);
+}
+
+// colour conversions are pointwise only between layouts of whole pixels.
+// demosaicing reads its neighbours, and subsampled YUV, whether planar
+// 4:2:0 or packed 4:2:2, shares chroma between pixels and changes the
+// image's shape, so everything from the first of those codes on is opaque
+// apart from the premultiplied alpha conversions
+inline
+cv::Size color_space_halo(int code)
+{
+    bool const whole_pixels = code < cv::COLOR_YUV2RGB_NV12
+        ||  code == cv::COLOR_RGBA2mRGBA
+        ||  code == cv::COLOR_mRGBA2RGBA;
+    if (!whole_pixels
+    ||  (code >= cv::COLOR_BayerBG2BGR      &&  code <= cv::COLOR_BayerGR2BGR)
+    ||  (code >= cv::COLOR_BayerBG2GRAY     &&  code <= cv::COLOR_BayerGR2GRAY)
+    ||  (code >= cv::COLOR_BayerBG2BGR_VNG  &&  code <= cv::COLOR_BayerGR2BGR_VNG))
+    {
+        return pipeline_stage::opaque();
+    }
+    return cv::Size();
+}
+
+// detail::gaussian_blur filters in 64-bit floating point, for which
+// OpenCV sizes a kernel derived from sigma to +/-4 sigma
+inline
+cv::Size gaussian_halo(int dx, int dy, double sigmaX, double sigmaY)
+{
+    if (sigmaY <= 0)
+        sigmaY = sigmaX;
+    if (dx <= 0)
+        dx = cvRound(sigmaX * 8 + 1) | 1;
+    if (dy <= 0)
+        dy = cvRound(sigmaY * 8 + 1) | 1;
+    return kernel_halo(dx, dy);
+}
+
+// kernels are anchored at their centre
+inline
+cv::Size kernel_halo(int dx, int dy)
+{
+    return cv::Size(dx / 2, dy / 2);
+}
+
+
+//
+// stage identity
+//
+
+// e.g. "gaussian_blur(5,5,0,0,4)". doubles are written with enough
+// digits to tell every value apart
+template<typename... Args>
+std::string signature(char const *name, Args const &...args)
+{
+    std::ostringstream stream;
+    stream.precision(17);
+    stream << name << '(';
+    [[maybe_unused]] char const *separator = "";
+    ((stream << separator << args, separator = ","), ...);
+    stream << ')';
+    return stream.str();
+}
+
+// FNV-1a over the pixels, row by row, which is the same for equal images
+// wherever their pixels are and on every run of the program
+inline
+uint64_t pixel_hash(cv::Mat const &image)
+{
+    auto const continuous = image.dims > 2? image.clone() : image;
+    auto const rows       = continuous.dims > 2? 1 : continuous.rows;
+    auto const bytes      = continuous.dims > 2? continuous.total() * continuous.elemSize() : size_t(continuous.cols) * continuous.elemSize();
+
+    uint64_t hash = 14695981039346656037ull;
+    for (int y=0; y<rows; ++y)
+    {
+        auto const row = continuous.ptr(y);
+        for (size_t x=0; x<bytes; ++x)
+        {
+            hash ^= row[x];
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+
+//
+// allocation accounting
+//
+
+#if CV_MAJOR_VERSION==2
+
+// OpenCV 2 has no replaceable default allocator, so nothing is counted
+inline void account_allocations(bool) {}
+inline allocation_counts allocations() { return {}; }
+inline void reset_allocation_peak() {}
+
+#else
+
+// installs nest, and overlapping runs on several threads share one
+inline
+void stacked_allocator::install(bool enable)
+{
+    std::lock_guard<std::mutex> lock(mutex());
+    auto &stack = installed();
+    if (enable  &&  installs_++ == 0)
+    {
+        inner_ = cv::Mat::getDefaultAllocator();
+        stack.push_back(this);
+        cv::Mat::setDefaultAllocator(this);
+    }
+    else if (!enable  &&  --installs_ == 0)
+    {
+        // the one above delegates to this one's delegate instead
+        auto const at = std::find(stack.begin(), stack.end(), this);
+        if (at + 1 != stack.end())
+            (*(at + 1))->inner_ = inner_.load();
+        else if (cv::Mat::getDefaultAllocator() == this)
+            cv::Mat::setDefaultAllocator(inner_);
+        stack.erase(at);
+    }
+}
+
+inline
+std::mutex &stacked_allocator::mutex()
+{
+    static auto *const mutex = new std::mutex();
+    return *mutex;
+}
+
+inline
+std::vector<stacked_allocator *> &stacked_allocator::installed()
+{
+    static auto *const stack = new std::vector<stacked_allocator *>();
+    return *stack;
+}
+
+// counts the pixel buffers allocated through it. buffers it allocated
+// return to the allocator that made them when they are released, even
+// after it is uninstalled, so it is never destroyed
+class accounting_allocator : public stacked_allocator
+{
+  public:
+    static accounting_allocator &instance()
+    {
+        static auto *const allocator = new accounting_allocator();
+        return *allocator;
+    }
+
+    allocation_counts counts() const
+    {
+        return { allocations_, bytes_, live_, peak_ };
+    }
+
+    void reset_peak()
+    {
+        peak_ = live_.load();
+    }
+
+    cv::UMatData *allocate(int dims, int const *sizes, int type, void *data, size_t *step, access_flags flags, cv::UMatUsageFlags usage) const override
+    {
+        auto const u = inner()->allocate(dims, sizes, type, data, step, flags, usage);
+        if (u  &&  (u->flags & cv::UMatData::USER_ALLOCATED) == 0)
+        {
+            u->currAllocator = this;
+            ++allocations_;
+            bytes_ += u->size;
+
+            auto const live = live_ += u->size;
+            auto peak = peak_.load();
+            while (live > peak  &&  !peak_.compare_exchange_weak(peak, live))
+                ;
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, access_flags flags, cv::UMatUsageFlags usage) const override
+    {
+        return u->prevAllocator->allocate(u, flags, usage);
+    }
+
+    // the buffer's UMatData still names the allocator that made it
+    void deallocate(cv::UMatData *u) const override
+    {
+        live_ -= u->size;
+        u->currAllocator = u->prevAllocator;
+        u->prevAllocator->deallocate(u);
+    }
+
+  private:
+    accounting_allocator() = default;
+
+    mutable std::atomic<size_t> allocations_{0};
+    mutable std::atomic<size_t> bytes_{0};
+    mutable std::atomic<size_t> live_{0};
+    mutable std::atomic<size_t> peak_{0};
+};
+
+inline
+void account_allocations(bool enable)
+{
+    accounting_allocator::instance().install(enable);
+}
+
+inline
+allocation_counts allocations()
+{
+    return accounting_allocator::instance().counts();
+}
+
+inline
+void reset_allocation_peak()
+{
+    accounting_allocator::instance().reset_peak();
+}
+
+#endif
+
+
+//
+// external memory
+//
+
+#if CV_MAJOR_VERSION==2
+
+// without a UMatData to release the memory with, the pixels are copied
+inline
+cv::Mat external_mat(cv::Mat const &view, std::function<void ()> release)
+{
+    auto const image = view.clone();
+    release();
+    return image;
+}
+
+#else
+
+// releases pixels that Mat headers refer to but OpenCV didn't allocate,
+// when the last of the headers is released
+class external_allocator : public cv::MatAllocator
+{
+  public:
+#if CV_MAJOR_VERSION >= 4
+    using access_flags = cv::AccessFlag;
+#else
+    using access_flags = int;
+#endif
+
+    static external_allocator &instance()
+    {
+        static auto *const allocator = new external_allocator();
+        return *allocator;
+    }
+
+    cv::UMatData *allocate(int dims, int const *sizes, int type, void *data, size_t *step, access_flags flags, cv::UMatUsageFlags usage) const override
+    {
+        return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+
+    bool allocate(cv::UMatData *u, access_flags, cv::UMatUsageFlags) const override
+    {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData *u) const override
+    {
+        if (!u)
+            return;
+
+        std::unique_ptr<std::function<void ()>> const release(static_cast<std::function<void ()> *>(u->userdata));
+        delete u;
+        (*release)();
+    }
+};
+
+// a Mat over pixels owned elsewhere, that calls `release` once the last
+// reference to them has gone. the pixels are marked as user allocated, so
+// stages don't overwrite them in place
+inline
+cv::Mat external_mat(cv::Mat const &view, std::function<void ()> release)
+{
+    auto image = view;
+    auto const u = new cv::UMatData(&external_allocator::instance());
+    u->data     = u->origdata = image.data;
+    u->size     = image.step[0] * size_t(image.rows);
+    u->flags   |= cv::UMatData::USER_ALLOCATED;
+    u->userdata = new std::function<void ()>(std::move(release));
+    u->refcount = 1;
+    image.u = u;
+    return image;
+}
+
+#endif
+
+
+//
+// image pyramids
+//
+
+// each level is resampled from the one before, which has most of the
+// detail it needs at a fraction of the cost of the full image, with
+// INTER_AREA, which OpenCV vectorises. it is the interpolation that a
+// shrinking resize from a level is closest to the direct resize with.
+// level sizes are rounded from the full size, as the detectors' own
+// pyramids round them, so they don't drift
+inline
+pyramid_image build_pyramid(cv::Mat const &image, int levels, double scale)
+{
+    pyramid_image pyramid;
+    pyramid.scale = scale;
+    pyramid.levels.push_back(image);
+    for (int i=1; i<levels  &&  !image.empty(); ++i)
+    {
+        auto const factor = std::pow(scale, i);
+        cv::Size const size(cvRound(image.cols / factor), cvRound(image.rows / factor));
+        if (size.width < 1  ||  size.height < 1)
+            break;
+
+        cv::Mat level;
+        cv::resize(pyramid.levels.back(), level, size, 0, 0, cv::INTER_AREA);
+        pyramid.levels.push_back(level);
+    }
+    return pyramid;
+}
+
+// the smallest level of the pyramid that is at least `size`, to resample
+// from instead of the image
+inline
+cv::Mat pyramid_level(pyramid_image const &pyramid, cv::Size size)
+{
+    size_t level = 0;
+    while (level+1 < pyramid.levels.size()
+       &&  pyramid.levels[level+1].cols >= size.width
+       &&  pyramid.levels[level+1].rows >= size.height)
+    {
+        ++level;
+    }
+    return pyramid.levels[level];
+}
+
+
 //
 // conditions
 //
@@ -101,6 +1099,68 @@ cv::Mat if_(cv::Mat const &image, std::function<bool const (cv::Mat const &)> co
     return cond(image)? fn(image) : image;
 }
 
+inline
+cv::Mat if_else(cv::Mat const &image, std::function<bool const (cv::Mat const &)> cond, pipeline_fn_t fn, pipeline_fn_t else_fn)
+{
+    return cond(image)? fn(image) : else_fn(image);
+}
+
+// state of an if_changed() stage, shared by the copies of its function
+struct change_gate
+{
+    explicit change_gate(double threshold) : threshold(threshold)
+    {
+    }
+
+    double const threshold;
+    std::mutex   mutex;
+    cv::Mat      signature;     // of the last image processed
+    cv::Mat      result;        // of processing it
+};
+
+// a thumbnail is enough to tell whether anything meaningful has changed
+inline
+cv::Mat change_signature(cv::Mat const &image)
+{
+    cv::Mat signature;
+    cv::resize(image, signature, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+    signature.convertTo(signature, CV_MAKETYPE(CV_32F, signature.channels()));
+    return signature;
+}
+
+// the mean absolute difference from the last image processed exceeds
+// the threshold, in which case the image becomes the new reference
+inline
+bool changed(cv::Mat const &image, change_gate &gate)
+{
+    auto signature = change_signature(image);
+    if (!gate.signature.empty()  &&  gate.signature.type() == signature.type())
+    {
+        auto const difference = cv::norm(signature, gate.signature, cv::NORM_L1);
+        if (difference <= gate.threshold * signature.total() * signature.channels())
+            return false;
+    }
+
+    gate.signature = signature;
+    return true;
+}
+
+// the comparison, the processing and keeping its result happen under one
+// lock, so an image that arrives meanwhile from another thread neither
+// races on the reference nor re-emits a result that isn't there yet.
+// a copy of the result is kept, as later stages may draw on the one returned
+inline
+cv::Mat if_changed(cv::Mat const &image, pipeline_fn_t const &fn, std::shared_ptr<change_gate> gate)
+{
+    std::lock_guard<std::mutex> lock(gate->mutex);
+    if (!changed(image, *gate))
+        return gate->result.clone();
+
+    auto result  = fn(image);
+    gate->result = result.clone();
+    return result;
+}
+
 
 //
 // image attributes
@@ -129,6 +1189,196 @@ to_keypoints(std::vector<std::vector<cv::Point>> const &regions)
     return keypoints;
 }
 
+// spread a budget of keypoints over a grid laid across them: each cell
+// keeps the strongest of its own, up to an equal share of the budget, and
+// the shares left over by sparse cells go to the strongest of the rest.
+// selecting instead of sorting keeps it linear in the number of keypoints.
+// returns the indices of those kept
+inline
+std::vector<size_t> bucket_keypoints(std::vector<cv::KeyPoint> const &keypoints, size_t count, cv::Size grid)
+{
+    std::vector<size_t> kept;
+    if (keypoints.size() <= count)
+    {
+        for (size_t i=0; i<keypoints.size(); ++i)
+            kept.push_back(i);
+        return kept;
+    }
+
+    auto const columns = std::max(grid.width, 1);
+    auto const rows    = std::max(grid.height, 1);
+    auto const cells   = size_t(columns) * size_t(rows);
+
+    cv::Point2f low  = keypoints[0].pt;
+    cv::Point2f high = keypoints[0].pt;
+    for (auto const &keypoint : keypoints)
+    {
+        low.x  = std::min(low.x,  keypoint.pt.x);
+        low.y  = std::min(low.y,  keypoint.pt.y);
+        high.x = std::max(high.x, keypoint.pt.x);
+        high.y = std::max(high.y, keypoint.pt.y);
+    }
+    auto const width  = std::max(high.x - low.x, 1.f);
+    auto const height = std::max(high.y - low.y, 1.f);
+    auto const cell_of = [&](cv::KeyPoint const &keypoint) {
+        auto const x = std::min(int((keypoint.pt.x - low.x) / width  * columns), columns - 1);
+        auto const y = std::min(int((keypoint.pt.y - low.y) / height * rows),    rows - 1);
+        return size_t(y) * size_t(columns) + size_t(x);
+    };
+
+    // sort the keypoints into their cells by counting
+    std::vector<size_t> start(cells + 1, 0);
+    for (auto const &keypoint : keypoints)
+        ++start[cell_of(keypoint) + 1];
+    for (size_t c=0; c<cells; ++c)
+        start[c+1] += start[c];
+
+    std::vector<size_t> order(keypoints.size());
+    auto next = start;
+    for (size_t i=0; i<keypoints.size(); ++i)
+        order[next[cell_of(keypoints[i])]++] = i;
+
+    auto const stronger = [&keypoints](size_t a, size_t b) {
+        return keypoints[a].response > keypoints[b].response;
+    };
+
+    // the shares that don't divide evenly, which are all of them when there
+    // are more cells than keypoints to keep, go to the cells whose best
+    // keypoints are the strongest
+    std::vector<char> extra(cells, 0);
+    if (count % cells != 0)
+    {
+        std::vector<float> best(cells, -std::numeric_limits<float>::infinity());
+        for (auto const &keypoint : keypoints)
+        {
+            auto &b = best[cell_of(keypoint)];
+            b = std::max(b, keypoint.response);
+        }
+
+        std::vector<size_t> ranked(cells);
+        for (size_t c=0; c<cells; ++c)
+            ranked[c] = c;
+        auto const nth = ranked.begin() + std::ptrdiff_t(count % cells);
+        std::nth_element(ranked.begin(), nth, ranked.end(), [&best](size_t a, size_t b) { return best[a] > best[b]; });
+        for (auto c=ranked.begin(); c!=nth; ++c)
+            extra[*c] = 1;
+    }
+
+    std::vector<size_t> rest;
+    kept.reserve(count);
+    for (size_t c=0; c<cells; ++c)
+    {
+        auto const share = count / cells + size_t(extra[c]);
+        auto const first = order.begin() + std::ptrdiff_t(start[c]);
+        auto       last  = order.begin() + std::ptrdiff_t(start[c+1]);
+        if (size_t(last - first) > share)
+        {
+            std::nth_element(first, first + std::ptrdiff_t(share), last, stronger);
+            rest.insert(rest.end(), first + std::ptrdiff_t(share), last);
+            last = first + std::ptrdiff_t(share);
+        }
+        kept.insert(kept.end(), first, last);
+    }
+
+    if (kept.size() < count)
+    {
+        auto const more = std::ptrdiff_t(count - kept.size());
+        std::nth_element(rest.begin(), rest.begin() + more, rest.end(), stronger);
+        kept.insert(kept.end(), rest.begin(), rest.begin() + more);
+    }
+    return kept;
+}
+
+// adaptive non-maximal suppression (Brown, Szeliski and Winder): keep the
+// keypoints furthest from any that is clearly stronger, which spreads
+// them out while still favouring strong ones. it is quadratic in the
+// number of candidates, so it chooses from a bounded pool
+inline
+std::vector<size_t> suppress_keypoints(std::vector<cv::KeyPoint> const &keypoints, std::vector<size_t> candidates, size_t count)
+{
+    if (candidates.size() <= count)
+        return candidates;
+
+    std::sort(candidates.begin(), candidates.end(), [&keypoints](size_t a, size_t b) {
+        return keypoints[a].response > keypoints[b].response;
+    });
+
+    // the squared distance of each candidate to the nearest one at least
+    // a tenth stronger, all of which come before it
+    std::vector<float> radius(candidates.size(), std::numeric_limits<float>::max());
+    size_t clearly_stronger = 0;
+    for (size_t i=0; i<candidates.size(); ++i)
+    {
+        auto const &keypoint = keypoints[candidates[i]];
+        while (clearly_stronger < i  &&  keypoint.response < .9f * keypoints[candidates[clearly_stronger]].response)
+            ++clearly_stronger;
+
+        for (size_t j=0; j<clearly_stronger; ++j)
+        {
+            auto const d = keypoint.pt - keypoints[candidates[j]].pt;
+            radius[i] = std::min(radius[i], d.x * d.x + d.y * d.y);
+        }
+    }
+
+    std::vector<size_t> order(candidates.size());
+    for (size_t i=0; i<order.size(); ++i)
+        order[i] = i;
+    std::nth_element(order.begin(), order.begin() + std::ptrdiff_t(count), order.end(), [&radius](size_t a, size_t b) {
+        return radius[a] != radius[b]? radius[a] > radius[b] : a < b;
+    });
+
+    std::vector<size_t> kept;
+    for (size_t i=0; i<count; ++i)
+        kept.push_back(candidates[order[i]]);
+    return kept;
+}
+
+// the indices of at most `count` keypoints, in their original order
+inline
+std::vector<size_t>
+limit_indices(std::vector<cv::KeyPoint> const &keypoints, size_t count, cv::Size grid, bool anms)
+{
+    std::vector<size_t> limited;
+    if (keypoints.size() <= count)
+    {
+        for (size_t i=0; i<keypoints.size(); ++i)
+            limited.push_back(i);
+        return limited;
+    }
+
+    // suppression chooses from the strongest few times the budget
+    size_t const pool = 4;
+    auto kept = bucket_keypoints(keypoints, anms? std::min(keypoints.size(), pool * count) : count, grid);
+    if (anms)
+        kept = suppress_keypoints(keypoints, std::move(kept), count);
+
+    std::vector<char> keep(keypoints.size(), 0);
+    for (auto const i : kept)
+        keep[i] = 1;
+
+    limited.reserve(kept.size());
+    for (size_t i=0; i<keypoints.size(); ++i)
+    {
+        if (keep[i])
+            limited.push_back(i);
+    }
+    return limited;
+}
+
+// at most `count` keypoints, in their original order
+inline
+std::vector<cv::KeyPoint>
+limit_keypoints(std::vector<cv::KeyPoint> const &keypoints, size_t count, cv::Size grid, bool anms)
+{
+    if (keypoints.size() <= count)
+        return keypoints;
+
+    std::vector<cv::KeyPoint> limited;
+    for (auto const i : limit_indices(keypoints, count, grid, anms))
+        limited.push_back(keypoints[i]);
+    return limited;
+}
+
 #if CV_MAJOR_VERSION==2
 inline auto create_detector(std::string const &detector_class)
 {
@@ -165,6 +1415,57 @@ inline cv::Ptr<cv::Feature2D> create_detector(std::string const &detector_class)
         return cv::SIFT::create();
     return {};
 }
+
+inline
+bool pyramid_detector(std::string const &detector_class)
+{
+    return detector_class == "ORB"  ||  detector_class == "BRISK";
+}
+
+// ORB and BRISK build a pyramid of their own. given one, they detect at
+// a single scale on each of its levels instead, and the keypoints are
+// mapped back to the image, with the level each was found on. ORB shares
+// out its features between the levels as it does over its own pyramid.
+// a keypoint's octave is its level only when the pyramid has ORB's scale
+// of 1.2, since ORB reads the octave as a level of its own pyramid
+inline
+bool detect_on_pyramid(
+    std::string         const &detector_class,
+    pyramid_image       const &pyramid,
+    std::vector<cv::KeyPoint> &keypoints,
+    std::vector<int>          &levels)
+{
+    if (!pyramid_detector(detector_class))
+        return false;
+
+    auto const count   = int(pyramid.levels.size());
+    auto const factor  = 1. / pyramid.scale;
+    auto const octaves = float(pyramid.scale) == 1.2f;
+    auto       desired = 500. * (1. - factor) / (1. - std::pow(factor, count));
+    keypoints.clear();
+    levels.clear();
+    for (int i=0; i<count; ++i, desired*=factor)
+    {
+        auto const detector = detector_class == "ORB"
+            ? cv::Ptr<cv::Feature2D>(cv::ORB::create(std::max(cvRound(desired), 1), float(pyramid.scale), 1))
+            : cv::Ptr<cv::Feature2D>(cv::BRISK::create(30, 0));
+
+        std::vector<cv::KeyPoint> found;
+        detector->detect(pyramid.levels[i], found, cv::Mat());
+
+        auto const level_scale = std::pow(pyramid.scale, i);
+        for (auto &keypoint : found)
+        {
+            keypoint.pt   = keypoint.pt * level_scale;
+            keypoint.size = float(keypoint.size * level_scale);
+            if (octaves)
+                keypoint.octave = i;
+            keypoints.push_back(keypoint);
+            levels.push_back(i);
+        }
+    }
+    return true;
+}
 #endif
 
 inline
@@ -178,6 +1479,24 @@ cv::Mat detect_keypoints(
     return image;
 }
 
+// detectors that can use a pyramid detect on its levels, and others on the
+// image. `levels` has the level of each keypoint, or is empty
+inline
+void detect_keypoints(
+    std::string         const &detector_class,
+    std::vector<cv::KeyPoint> &keypoints,
+    std::vector<int>          &levels,
+    pyramid_image       const &pyramid)
+{
+#if CV_MAJOR_VERSION==3
+    if (detect_on_pyramid(detector_class, pyramid, keypoints, levels))
+        return;
+#endif
+
+    levels.clear();
+    detect_keypoints(detector_class, keypoints, pyramid.levels[0]);
+}
+
 inline
 cv::Mat detect_regions(
     std::string                   const &detector,
@@ -285,6 +1604,90 @@ cv::Mat extract_keypoints(
     return new_descriptors;
 }
 
+// the descriptors of keypoints found on the levels of a pyramid. ORB takes
+// a keypoint marked with its octave from the same level of its own
+// pyramid, which is the keypoint's level when the pyramid has ORB's scale.
+// otherwise each keypoint is described on its own level, at that level's
+// scale, and the descriptors are gathered back in the keypoints' order
+inline
+cv::Mat extract_keypoints(
+    std::string                      extractor_class,
+    std::vector<cv::KeyPoint> const &keypoints,
+    std::vector<int>          const &levels,
+    pyramid_image             const &pyramid)
+{
+    if (levels.size() != keypoints.size()
+    ||  (extractor_class == "ORB"  &&  float(pyramid.scale) == 1.2f))
+        return extract_keypoints(extractor_class, keypoints, pyramid.levels[0]);
+
+    std::vector<std::vector<cv::KeyPoint>> on_level(pyramid.levels.size());
+    std::vector<std::vector<int>>          rows(pyramid.levels.size());
+    for (size_t i=0; i<keypoints.size(); ++i)
+    {
+        auto const level       = size_t(levels[i]);
+        auto const level_scale = 1. / std::pow(pyramid.scale, levels[i]);
+        auto keypoint   = keypoints[i];
+        keypoint.pt     = keypoint.pt * level_scale;
+        keypoint.size   = float(keypoint.size * level_scale);
+        keypoint.octave = 0;
+        on_level[level].push_back(keypoint);
+        rows[level].push_back(int(i));
+    }
+
+    cv::Mat descriptors;
+    for (size_t level=0; level<on_level.size(); ++level)
+    {
+        if (on_level[level].empty())
+            continue;
+
+        auto const found = extract_keypoints(extractor_class, on_level[level], pyramid.levels[level]);
+        if (found.empty())
+            continue;
+        if (descriptors.empty())
+            descriptors = cv::Mat::zeros(int(keypoints.size()), found.cols, found.type());
+        for (size_t j=0; j<rows[level].size(); ++j)
+            found.row(int(j)).copyTo(descriptors.row(rows[level][j]));
+    }
+    return descriptors;
+}
+
+#if CV_MAJOR_VERSION==3
+// the extractor detects the same keypoints as the detector: they're the
+// same algorithm with the same detection parameters. AKAZE detects the
+// same keypoints whichever descriptor it extracts
+inline
+bool detects_as(std::string const &extractor_class, std::string const &detector_class)
+{
+    if (extractor_class == "AKAZE")
+        return detector_class == "AKAZE"  ||  detector_class == "MLDB";
+    return extractor_class == detector_class
+       &&  (extractor_class == "ORB"  ||  extractor_class == "BRISK"  ||  extractor_class == "KAZE"  ||  extractor_class == "SIFT");
+}
+#endif
+
+// detect the keypoints and extract their descriptors with one call, when
+// the extractor detects the same keypoints as the detector, or else return
+// false
+inline
+bool detect_and_extract(
+    std::string         const &detector_class,
+    std::string         const &extractor_class,
+    std::vector<cv::KeyPoint> &keypoints,
+    cv::Mat                   &descriptors,
+    cv::Mat             const &image)
+{
+#if CV_MAJOR_VERSION==3
+    if (!detects_as(extractor_class, detector_class))
+        return false;
+
+    keypoints.clear();
+    create_descriptor_extractor(extractor_class)->detectAndCompute(image, cv::Mat(), keypoints, descriptors);
+    return true;
+#else
+    return false;
+#endif
+}
+
 inline
 cv::Mat extract_regions(
     std::string                                extractor_class,
@@ -297,7 +1700,7 @@ cv::Mat extract_regions(
 inline
 cv::Mat save(cv::Mat const &image, std::filesystem::path pathname)
 {
-    return imwrite(pathname.u8string(), image)? image : cv::Mat();
+    return imwrite(utf8(pathname), image)? image : cv::Mat();
 }
 
 inline
@@ -0,0 +1,426 @@
+#pragma once
+
+namespace opencv_pipeline {
+
+namespace detail {
+
+// a glob of one path component: `*` matches any run of characters, `?`
+// any one, and `[a-z]` or `[!a-z]` one in or out of a set. names compare
+// without case on Windows, as its file system does
+inline
+bool glob_match(char const *pattern, char const *name)
+{
+    auto const same = [](char a, char b) {
+#ifdef _WIN32
+        return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+#else
+        return a == b;
+#endif
+    };
+
+    for (; *pattern; ++pattern, ++name)
+    {
+        switch (*pattern)
+        {
+          case '*':
+            for (auto rest=name; ; ++rest)
+            {
+                if (glob_match(pattern + 1, rest))
+                    return true;
+                if (!*rest)
+                    return false;
+            }
+
+          case '?':
+            if (!*name)
+                return false;
+            break;
+
+          case '[':
+          {
+            if (!*name)
+                return false;
+            auto       set    = pattern + 1;
+            bool const negate = *set == '!';
+            if (negate)
+                ++set;
+
+            bool found = false;
+            auto end   = set;
+            for (; *end  &&  (*end != ']'  ||  end == set); ++end)
+            {
+                if (end[1] == '-'  &&  end[2]  &&  end[2] != ']')
+                {
+                    found |= end[0] <= *name  &&  *name <= end[2];
+                    end   += 2;
+                }
+                else
+                    found |= same(*end, *name);
+            }
+            if (!*end)
+            {
+                // no closing bracket: a literal '['
+                if (!same('[', *name))
+                    return false;
+                break;
+            }
+            if (found == negate)
+                return false;
+            pattern = end;
+            break;
+          }
+
+          default:
+            if (!same(*pattern, *name))
+                return false;
+            break;
+        }
+    }
+    return !*name;
+}
+
+// the components of a path below the root match the components of the
+// pattern, where `**` matches any number of directories. a `prefix` match
+// accepts a directory that a match could lie within
+inline
+bool glob_match(
+    std::vector<std::string> const &pattern, size_t p,
+    std::vector<std::string> const &names,   size_t n,
+    bool                            prefix)
+{
+    if (n == names.size()  &&  prefix)
+        return true;
+    if (p == pattern.size())
+        return n == names.size();
+    if (pattern[p] == "**")
+        return glob_match(pattern, p+1, names, n, prefix)  ||  (n < names.size()  &&  glob_match(pattern, p, names, n+1, prefix));
+    return n < names.size()
+       &&  glob_match(pattern[p].c_str(), names[n].c_str())
+       &&  glob_match(pattern, p+1, names, n+1, prefix);
+}
+
+inline
+bool wildcard(std::string const &component)
+{
+    return component.find_first_of("*?[") != std::string::npos;
+}
+
+// FNV-1a, which is the same on every machine and compiler
+inline
+uint64_t fnv1a(std::string const &text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (auto const c : text)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// the number of pixels of an image, read from the header of the formats
+// that give its size in their first bytes, or else the size of the file.
+// either is a cheap estimate of how long the image takes to process
+inline
+uint64_t probe_cost(std::filesystem::path const &pathname)
+{
+    std::error_code error;
+    auto const bytes = std::filesystem::file_size(pathname, error);
+    if (error)
+        return 0;
+
+    std::ifstream file(pathname, std::ios::binary);
+    std::array<unsigned char, 32> h = {};
+    file.read(reinterpret_cast<char *>(h.data()), h.size());
+    auto const got = size_t(file.gcount());
+
+    auto const be32 = [&h](size_t i) { return uint64_t(h[i]) << 24 | uint64_t(h[i+1]) << 16 | uint64_t(h[i+2]) << 8 | h[i+3]; };
+    auto const le32 = [&h](size_t i) { return uint64_t(h[i]) | uint64_t(h[i+1]) << 8 | uint64_t(h[i+2]) << 16 | uint64_t(h[i+3]) << 24; };
+    auto const le16 = [&h](size_t i) { return uint64_t(h[i]) | uint64_t(h[i+1]) << 8; };
+
+    if (got >= 24  &&  std::memcmp(h.data(), "\x89PNG", 4) == 0)
+        return be32(16) * be32(20);
+    if (got >= 10  &&  std::memcmp(h.data(), "GIF8", 4) == 0)
+        return le16(6) * le16(8);
+    if (got >= 26  &&  h[0] == 'B'  &&  h[1] == 'M')
+    {
+        // a negative height marks a top-down bitmap
+        auto const height = int32_t(uint32_t(le32(22)));
+        return le32(18) * uint64_t(height < 0? -int64_t(height) : height);
+    }
+    if (got >= 4  &&  h[0] == 0xff  &&  h[1] == 0xd8)
+    {
+        // walk the JPEG markers to the start of frame, which has the size
+        file.clear();
+        file.seekg(2);
+        unsigned char marker[4];
+        while (file.read(reinterpret_cast<char *>(marker), 4)  &&  marker[0] == 0xff)
+        {
+            auto const length = size_t(marker[2]) << 8 | marker[3];
+            bool const sof = marker[1] >= 0xc0  &&  marker[1] <= 0xcf
+                         &&  marker[1] != 0xc4  &&  marker[1] != 0xc8  &&  marker[1] != 0xcc;
+            if (sof)
+            {
+                unsigned char size[5];
+                if (!file.read(reinterpret_cast<char *>(size), 5))
+                    break;
+                return (uint64_t(size[1]) << 8 | size[2]) * (uint64_t(size[3]) << 8 | size[4]);
+            }
+            if (length < 2)
+                break;
+            file.seekg(std::streamoff(length - 2), std::ios::cur);
+        }
+    }
+    return bytes;
+}
+
+}   // namespace detail
+
+// the files below a directory that match a pattern such as
+// "images/**/*.png", found as they are iterated rather than listed up
+// front. `**` matches any number of directories, and the other wildcards
+// those of a single name. files are found in no particular order
+//
+// shard(i, n) keeps the files whose path below the root hashes to i of n,
+// so n processes or machines can each take a shard of one tree without
+// coordinating. largest_first() lists the files before iterating, in
+// order of the pixels their headers report, so the biggest images don't
+// straggle at the end of a parallel batch
+class walk
+{
+  public:
+    class iterator
+    {
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type        = std::filesystem::path;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = std::filesystem::path const *;
+        using reference         = std::filesystem::path const &;
+
+        iterator()
+        {
+        }
+
+        reference operator*() const
+        {
+            return ordered_? (*ordered_)[index_] : current_;
+        }
+
+        pointer operator->() const
+        {
+            return &**this;
+        }
+
+        iterator &operator++()
+        {
+            if (ordered_)
+                done_ = ++index_ >= ordered_->size();
+            else
+                find(true);
+            return *this;
+        }
+
+        // an iterator only compares with the end
+        bool operator==(iterator const &rhs) const
+        {
+            return done_ == rhs.done_;
+        }
+
+        bool operator!=(iterator const &rhs) const
+        {
+            return !(*this == rhs);
+        }
+
+      private:
+        friend class walk;
+
+        // a copy of the walk, so the iterator outlives a temporary one
+        explicit iterator(walk const &w) : walk_(std::make_shared<walk const>(w))
+        {
+            std::error_code error;
+            files_ = std::filesystem::recursive_directory_iterator(
+                walk_->root_, std::filesystem::directory_options::skip_permission_denied, error);
+            if (!error)
+                find(false);
+        }
+
+        explicit iterator(std::shared_ptr<std::vector<std::filesystem::path>> ordered)
+          : ordered_(std::move(ordered)), done_(ordered_->empty())
+        {
+        }
+
+        // the next matching file, skipping directories that can't hold one
+        void find(bool advance)
+        {
+            std::error_code error;
+            std::filesystem::recursive_directory_iterator const end;
+            if (advance)
+                files_.increment(error);
+            for (; !error  &&  files_ != end; files_.increment(error))
+            {
+                auto const &entry = *files_;
+                std::vector<std::string> names;
+                for (auto const &name : entry.path().lexically_relative(walk_->root_))
+                    names.push_back(detail::utf8(name));
+
+                std::error_code ignored;
+                if (entry.is_directory(ignored))
+                {
+                    if (!detail::glob_match(walk_->pattern_, 0, names, 0, true))
+                        files_.disable_recursion_pending();
+                }
+                else if (entry.is_regular_file(ignored)  &&  walk_->selected(names))
+                {
+                    current_ = entry.path();
+                    done_    = false;
+                    return;
+                }
+            }
+            done_ = true;
+        }
+
+        std::shared_ptr<walk const>                           walk_;
+        std::filesystem::recursive_directory_iterator         files_;
+        std::filesystem::path                                 current_;
+        std::shared_ptr<std::vector<std::filesystem::path>>   ordered_;
+        size_t                                                index_ = 0;
+        bool                                                  done_  = true;
+    };
+
+    explicit walk(std::filesystem::path const &pattern)
+    {
+        // the root is the leading run of components without wildcards
+        auto const generic = pattern.lexically_normal();
+        bool       literal = true;
+        for (auto const &component : generic)
+        {
+            auto const name = detail::utf8(component);
+            if (literal  &&  !detail::wildcard(name))
+                root_ /= component;
+            else
+            {
+                literal = false;
+                pattern_.push_back(name);
+            }
+        }
+
+        // a pattern naming one file
+        if (pattern_.empty()  &&  !root_.empty())
+        {
+            pattern_.push_back(detail::utf8(root_.filename()));
+            root_ = root_.parent_path();
+        }
+        if (root_.empty())
+            root_ = ".";
+    }
+
+    walk &shard(size_t index, size_t count) &
+    {
+        shard_index_ = index;
+        shard_count_ = std::max<size_t>(count, 1);
+        return *this;
+    }
+
+    // a temporary walk is set up by value, so a range-for over
+    // walk(...).shard(i, n) iterates a walk that lives as long as the loop
+    walk shard(size_t index, size_t count) &&
+    {
+        return std::move(shard(index, count));
+    }
+
+    walk &largest_first(bool enable=true) &
+    {
+        largest_first_ = enable;
+        return *this;
+    }
+
+    walk largest_first(bool enable=true) &&
+    {
+        return std::move(largest_first(enable));
+    }
+
+    iterator begin() const
+    {
+        if (!largest_first_)
+            return iterator(*this);
+
+        std::vector<std::pair<uint64_t, std::filesystem::path>> costed;
+        for (iterator file(*this), last; file != last; ++file)
+            costed.emplace_back(detail::probe_cost(*file), *file);
+        std::sort(costed.begin(), costed.end(), [](auto const &a, auto const &b) {
+            return a.first != b.first? a.first > b.first : a.second < b.second;
+        });
+
+        auto ordered = std::make_shared<std::vector<std::filesystem::path>>();
+        for (auto &file : costed)
+            ordered->push_back(std::move(file.second));
+        return iterator(std::move(ordered));
+    }
+
+    iterator end() const
+    {
+        return iterator();
+    }
+
+    // all the files at once, for the batch operators that need them
+    std::vector<std::filesystem::path> paths() const
+    {
+        return std::vector<std::filesystem::path>(begin(), end());
+    }
+
+    bool sorted_by_cost() const
+    {
+        return largest_first_;
+    }
+
+  private:
+    bool selected(std::vector<std::string> const &names) const
+    {
+        if (!detail::glob_match(pattern_, 0, names, 0, false))
+            return false;
+        if (shard_count_ == 1)
+            return true;
+
+        // the path below the root, with '/' on every system
+        std::string relative;
+        for (auto const &name : names)
+            relative += (relative.empty()? "" : "/") + name;
+        return detail::fnv1a(relative) % shard_count_ == shard_index_;
+    }
+
+    std::filesystem::path    root_;
+    std::vector<std::string> pattern_;
+    size_t                   shard_index_   = 0;
+    size_t                   shard_count_   = 1;
+    bool                     largest_first_ = false;
+};
+
+// process each file as soon as the walk finds it
+inline
+std::vector<cv::Mat>
+operator|(walk const &files, persistent_pipeline const &pipeline)
+{
+    std::vector<cv::Mat> results;
+    for (auto const &pathname : files)
+        results.emplace_back(pathname | load | pipeline);
+    return results;
+}
+
+inline
+batch_results operator|(walk const &files, detail::try_each_t const &batch)
+{
+    return detail::try_items(files.begin(), files.end(), batch.pipeline);
+}
+
+// the largest files first are dealt out to the stripes in turn, as a
+// stripe of the first few would hold all the costly ones. the results are
+// then combined in the order of the stripes rather than that of the files
+template<typename Acc, typename Combine, typename Merge>
+Acc operator|(walk const &files, detail::reduce_t<Acc, Combine, Merge> const &reduction)
+{
+    auto const paths = files.paths();
+    return detail::run_reduce(paths.data(), paths.size(), reduction, files.sorted_by_cost());
+}
+
+}   // namespace opencv_pipeline
@@ -15,7 +15,7 @@ class file_not_found : public std::runtime_error
     }
 
     file_not_found(std::filesystem::path pathname)
-      : file_not_found(pathname.u8string().c_str())
+      : file_not_found(detail::utf8(pathname).c_str())
     {
     }
 };
@@ -47,6 +47,16 @@ class end_of_file : public std::exception
     }
 };
 
+// thrown by a video pipeline stage to discard the current frame and
+// continue with the next
+class frame_dropped : public std::exception
+{
+  public:
+    frame_dropped()
+    {
+    }
+};
+
 }   // namespace exceptions
 
 }   // namespace opencv_pipeline
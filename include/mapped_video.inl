@@ -0,0 +1,394 @@
+#pragma once
+
+#include "platform.h"
+
+namespace opencv_pipeline {
+
+namespace detail {
+
+// a file mapped copy-on-write into memory: pages written to, such as
+// by drawing into a frame, become private copies and the file is unchanged
+class mapped_file
+{
+  public:
+    explicit mapped_file(std::filesystem::path const &pathname)
+    {
+#ifdef _WIN32
+        file_ = CreateFileW(pathname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (file_ == INVALID_HANDLE_VALUE  ||  !GetFileSizeEx(file_, &size))
+            throw exceptions::file_not_found(pathname);
+        size_ = size_t(size.QuadPart);
+        if (size_ == 0)
+            return;
+
+        mapping_ = CreateFileMappingW(file_, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        data_ = mapping_? static_cast<uchar *>(MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0)) : nullptr;
+#else
+        auto const fd = ::open(pathname.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0  ||  fstat(fd, &status) != 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            throw exceptions::file_not_found(pathname);
+        }
+        size_ = size_t(status.st_size);
+        if (size_ == 0)
+        {
+            ::close(fd);
+            return;
+        }
+
+        auto const data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        data_ = data == MAP_FAILED? nullptr : static_cast<uchar *>(data);
+#endif
+        if (!data_)
+        {
+            release();
+            throw std::runtime_error("Unable to map file: " + detail::utf8(pathname));
+        }
+    }
+
+    ~mapped_file()
+    {
+        release();
+    }
+
+    mapped_file(mapped_file const &)            = delete;
+    mapped_file &operator=(mapped_file const &) = delete;
+
+    uchar *data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+  private:
+    void release()
+    {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        mapping_ = nullptr;
+        file_    = INVALID_HANDLE_VALUE;
+#else
+        if (data_)
+            munmap(data_, size_);
+#endif
+        data_ = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE file_    = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+    uchar *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// the header of a raw frame file, followed by frames of `height` rows of
+// `width` elements of `type`, packed
+struct raw_video_header
+{
+    static constexpr char signature[8] = { 'O', 'C', 'V', 'R', 'A', 'W', '1', '\n' };
+
+    char    magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t type;
+    int32_t reserved;
+    double  fps;
+    uint8_t padding[32];
+};
+static_assert(sizeof(raw_video_header) == 64, "raw video header is 64 bytes");
+
+// a header's type names one of OpenCV's depths and a channel count, so
+// that a corrupt one isn't taken as the size of the frames
+inline
+bool valid_raw_type(int32_t type)
+{
+    if (type < 0  ||  type != CV_MAT_TYPE(type))
+        return false;
+    auto const depth = CV_MAT_DEPTH(type);
+#ifdef CV_16F
+    if (depth == CV_16F)
+        return true;
+#endif
+    return depth <= CV_64F;
+}
+
+// the geometry of the planar 8-bit YUV4MPEG2 frames, as the rows of a
+// single channel image `width` wide. 4:2:0 frames are in the layout of
+// cv::COLOR_YUV2BGR_I420, whichever siting their chroma has, but deeper
+// ones such as C420p10 are not 8-bit and are refused
+inline
+int y4m_rows(std::string const &chroma, int width, int height)
+{
+    if (chroma.empty()  ||  chroma == "C420"  ||  chroma == "C420jpeg"  ||  chroma == "C420paldv"  ||  chroma == "C420mpeg2")
+    {
+        if (width % 2  ||  height % 2)
+            throw std::runtime_error("4:2:0 YUV4MPEG2 frames must have even dimensions");
+        return height * 3 / 2;
+    }
+    if (chroma == "C422")
+    {
+        if (width % 2)
+            throw std::runtime_error("4:2:2 YUV4MPEG2 frames must have an even width");
+        return height * 2;
+    }
+    if (chroma == "C444")
+        return height * 3;
+    if (chroma == "Cmono")
+        return height;
+    throw std::runtime_error("Unsupported YUV4MPEG2 colour space: " + chroma);
+}
+
+}   // namespace detail
+
+// an uncompressed video file, YUV4MPEG2 (.y4m) or the raw frames written
+// by record_frames, mapped into memory. frames are views of the mapping
+// and can be read in any order. YUV4MPEG2 frames are single channel
+// planar images; convert 4:2:0 ones with color_space(cv::COLOR_YUV2BGR_I420)
+class mapped_video
+{
+  public:
+    explicit mapped_video(std::filesystem::path const &pathname)
+      : file_(std::make_shared<detail::mapped_file>(pathname))
+    {
+        auto const data = reinterpret_cast<char const *>(file_->data());
+        auto const size = file_->size();
+        if (size >= sizeof(detail::raw_video_header)
+        &&  std::equal(data, data + 8, detail::raw_video_header::signature))
+        {
+            open_raw();
+        }
+        else if (size >= 10  &&  std::string(data, 10) == "YUV4MPEG2 ")
+            open_y4m();
+        else
+            throw std::runtime_error("Not a YUV4MPEG2 or raw video file: " + detail::utf8(pathname));
+    }
+
+    size_t size() const
+    {
+        return frames_.size();
+    }
+
+    double fps() const
+    {
+        return fps_;
+    }
+
+    // the frame at `index`, without copying. the mapping stays open while
+    // any frame refers to it, and drawing into a frame changes the mapped
+    // copy, not the file
+    cv::Mat operator[](size_t index) const
+    {
+        auto const file = file_;
+        cv::Mat const view(rows_, cols_, type_, file_->data() + frames_.at(index));
+        return detail::external_mat(view, [file] {});
+    }
+
+  private:
+    void open_raw()
+    {
+        detail::raw_video_header header;
+        std::memcpy(&header, file_->data(), sizeof(header));
+        if (header.width <= 0  ||  header.height <= 0  ||  !detail::valid_raw_type(header.type))
+            throw std::runtime_error("Bad raw video header");
+
+        rows_ = header.height;
+        cols_ = header.width;
+        type_ = header.type;
+        fps_  = header.fps;
+
+        // a partly written last frame is ignored
+        auto const frame_size = size_t(rows_) * cols_ * CV_ELEM_SIZE(type_);
+        for (auto offset = sizeof(header); offset + frame_size <= file_->size(); offset += frame_size)
+            frames_.push_back(offset);
+    }
+
+    void open_y4m()
+    {
+        auto const data = reinterpret_cast<char const *>(file_->data());
+        auto const end  = data + file_->size();
+        auto const line = [end](char const *p) {
+            return std::find(p, end, '\n');
+        };
+
+        // YUV4MPEG2 W<width> H<height> F<num>:<den> C<chroma> ...
+        auto const header_end = line(data);
+        std::istringstream header(std::string(data, header_end));
+        std::string tag, chroma;
+        int width = 0, height = 0;
+        header >> tag;
+        while (header >> tag)
+        {
+            if (tag[0] == 'W')
+                width = std::stoi(tag.substr(1));
+            else if (tag[0] == 'H')
+                height = std::stoi(tag.substr(1));
+            else if (tag[0] == 'C')
+                chroma = tag;
+            else if (tag[0] == 'F')
+            {
+                double num = 0., den = 1.;
+                char colon;
+                std::istringstream(tag.substr(1)) >> num >> colon >> den;
+                fps_ = den > 0.? num / den : 0.;
+            }
+        }
+        if (width <= 0  ||  height <= 0)
+            throw std::runtime_error("Bad YUV4MPEG2 header");
+
+        rows_ = detail::y4m_rows(chroma, width, height);
+        cols_ = width;
+        type_ = CV_8UC1;
+
+        // each frame is a FRAME line, with optional parameters, then the
+        // planes. a partly written last frame is ignored
+        auto const frame_size = size_t(rows_) * cols_;
+        for (auto p = header_end; p != end  &&  ++p != end; )
+        {
+            auto const frame_end = line(p);
+            if (frame_end == end  ||  std::string(p, std::min<size_t>(5, frame_end - p)) != "FRAME"
+            ||  size_t(end - frame_end - 1) < frame_size)
+            {
+                break;
+            }
+            frames_.push_back(size_t(frame_end + 1 - data));
+            p = frame_end + frame_size;
+        }
+    }
+
+    std::shared_ptr<detail::mapped_file> file_;
+    std::vector<size_t>                  frames_;   // offsets of the frames in the file
+    int                                  rows_ = 0;
+    int                                  cols_ = 0;
+    int                                  type_ = 0;
+    double                               fps_  = 0.;
+};
+
+// play a mapped video file from frame `first`
+inline
+video_pipeline
+replay(std::filesystem::path const &pathname, size_t first=0)
+{
+    try
+    {
+        auto const video = std::make_shared<mapped_video>(pathname);
+        return video_pipeline(
+            [video, next=first]() mutable {
+                return next < video->size()? (*video)[next++] : cv::Mat();
+            },
+            std::string());
+    }
+    catch (std::exception const &e)
+    {
+        return video_pipeline(std::function<cv::Mat ()>(), "Unable to open video file: " + detail::utf8(pathname) + ": " + e.what());
+    }
+}
+
+
+namespace detail {
+
+// appends frames to a YUV4MPEG2 or raw frame file. every frame must have
+// the size and type of the first
+class frame_recorder
+{
+  public:
+    frame_recorder(std::filesystem::path pathname, double fps)
+      : pathname_(std::move(pathname)), fps_(fps)
+    {
+        auto extension = detail::utf8(pathname_.extension());
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(std::tolower(c)); });
+        y4m_ = extension == ".y4m";
+    }
+
+    cv::Mat const &operator()(cv::Mat const &frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!file_.is_open())
+            open(frame);
+        else if (frame.size() != size_  ||  frame.type() != type_)
+            throw std::invalid_argument("recorded frames must all have the same size and type");
+
+        // frames that are mapped in may have padded rows
+        cv::Mat planes = frame;
+        if (y4m_  &&  frame.type() == CV_8UC3)
+            cv::cvtColor(frame, planes, cv::COLOR_BGR2YUV_I420);
+
+        if (y4m_)
+            file_ << "FRAME\n";
+        for (int row=0; row<planes.rows; ++row)
+            file_.write(reinterpret_cast<char const *>(planes.ptr(row)), std::streamsize(planes.cols * planes.elemSize()));
+        if (!file_)
+            throw std::runtime_error("Unable to write frame to " + detail::utf8(pathname_));
+        return frame;
+    }
+
+  private:
+    void open(cv::Mat const &frame)
+    {
+        size_ = frame.size();
+        type_ = frame.type();
+        if (y4m_  &&  type_ != CV_8UC1  &&  (type_ != CV_8UC3  ||  size_.width % 2  ||  size_.height % 2))
+            throw std::invalid_argument("YUV4MPEG2 records 8-bit grey frames, or BGR frames of even size");
+
+        file_.open(pathname_, std::ios::binary | std::ios::trunc);
+        if (!file_)
+            throw std::runtime_error("Unable to create " + detail::utf8(pathname_));
+
+        if (y4m_)
+        {
+            file_ << "YUV4MPEG2 W" << size_.width << " H" << size_.height
+                  << " F" << cvRound(fps_ * 1000.) << ":1000"
+                  << " Ip A1:1 " << (type_ == CV_8UC1? "Cmono" : "C420jpeg") << '\n';
+        }
+        else
+        {
+            raw_video_header header = {};
+            std::copy(std::begin(raw_video_header::signature), std::end(raw_video_header::signature), header.magic);
+            header.width  = size_.width;
+            header.height = size_.height;
+            header.type   = type_;
+            header.fps    = fps_;
+            file_.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        }
+    }
+
+    std::filesystem::path const pathname_;
+    double const                fps_;
+    bool                        y4m_;
+    std::mutex                  mutex_;
+    std::ofstream               file_;
+    cv::Size                    size_;
+    int                         type_ = 0;
+};
+
+}   // namespace detail
+
+// append each frame to a file that mapped_video and replay can read, to
+// capture a stream for deterministic replay. a .y4m file is YUV4MPEG2,
+// of grey frames or BGR frames converted to 4:2:0; any other is a raw
+// frame file, which records frames of any type exactly
+inline
+pipeline_fn_t
+record_frames(std::filesystem::path pathname, double fps=30.)
+{
+    auto const recorder = std::make_shared<detail::frame_recorder>(std::move(pathname), fps);
+    return [recorder](cv::Mat const &frame) -> cv::Mat {
+        return (*recorder)(frame);
+    };
+}
+
+}   // namespace opencv_pipeline
@@ -12,16 +12,112 @@
 #include <opencv2/xfeatures2d/nonfree.hpp>
 #endif
 
+#if defined(__cpp_impl_coroutine)  &&  __has_include(<coroutine>)
+#include <coroutine>
+#define OPENCV_PIPELINE_COROUTINES 1
+#endif
+
 #include <filesystem>
+#include "utf8.h"
 #include "exceptions.h"
 #include <functional>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 
 namespace opencv_pipeline {
 
 using pipeline_fn_t = std::function<cv::Mat (cv::Mat const &)>;
 
+namespace detail {
+
+// a built-in pointwise operation. a persistent_pipeline runs consecutive
+// stages made of these as a single pass over the image
+struct pointwise_op
+{
+    typedef
+    enum { bgr2gray, gray2bgr, convert, subtract, abs, threshold, lut }
+    kind_t;
+
+    pointwise_op(kind_t kind, int type=0, double alpha=1., double beta=0., cv::Mat operand=cv::Mat())
+      : kind(kind), type(type), alpha(alpha), beta(beta), operand(std::move(operand))
+    {
+    }
+
+    kind_t  kind;
+    int     type;       // convert: the result type; threshold: the threshold type
+    double  alpha;      // convert: the scale;       threshold: thresh
+    double  beta;       // convert: the offset;      threshold: maxval
+    cv::Mat operand;    // subtract: the image subtracted; lut: the table
+};
+
+}   // namespace detail
+
+// an image with the levels of its pyramid, each `scale` times smaller than
+// the one before. levels[0] is the image itself. made by image | pyramid(),
+// it is passed on explicitly to the stages and detectors that use it
+struct pyramid_image
+{
+    double               scale = 2.;
+    std::vector<cv::Mat> levels;
+};
+
+// a pipeline function that also describes its spatial footprint. each
+// output pixel is computed from the input pixels within `halo` of it; a
+// negative halo marks a stage that depends on the whole image. stages
+// that are pure functions of their input carry a signature naming the
+// function and its arguments, so equal stages can be recognised
+struct pipeline_stage : pipeline_fn_t
+{
+    pipeline_stage(pipeline_fn_t fn, cv::Size halo=opaque(), std::string signature=std::string())
+      : pipeline_fn_t(std::move(fn)), halo(halo), signature(std::move(signature))
+    {
+    }
+
+    static cv::Size opaque()
+    {
+        return cv::Size(-1, -1);
+    }
+
+    bool local() const
+    {
+        return halo.width >= 0  &&  halo.height >= 0;
+    }
+
+    // run the stage on an image that is not needed afterwards. when
+    // nothing else refers to its pixels, stages that can overwrite their
+    // input do so instead of allocating a result
+    using pipeline_fn_t::operator();
+    cv::Mat operator()(cv::Mat &&image) const;
+
+    cv::Size                          halo;
+    std::string                       signature;  // empty if the stage is not pure
+    std::optional<cv::Rect>           crop;       // region kept by a crop() stage
+    std::function<bool (cv::Mat &)>   inplace;    // overwrite the image with the result, if possible
+    std::vector<detail::pointwise_op> pointwise;  // the stage as operations that can be fused
+    std::function<cv::Mat (pyramid_image const &)> from_pyramid;  // the stage run on a pyramid's levels, if it can use them
+    std::function<std::string ()>                  stable_signature;  // the signature across runs, when `signature` holds addresses
+};
+
 struct waitkey
 {
     explicit waitkey(int delay) : delay_(delay)
@@ -62,15 +158,82 @@ cv::Mat operator|(cv::Mat const &image, pipeline_terminator)
     return image;
 }
 
+// the cost of one stage of a persistent_pipeline, summed over the runs
+// measured. allocations count the pixel buffers of cv::Mat
+struct stage_stats
+{
+    std::string                               name;            // the stage's signature, or its position
+    size_t                                    runs        = 0;
+    std::chrono::duration<double, std::milli> time        {};
+    size_t                                    allocations = 0;
+    size_t                                    bytes       = 0; // allocated
+    size_t                                    peak_bytes  = 0; // most live at once above the start of a run
+};
+
+// stages fused into one pass over the image, such as gray | threshold,
+// are measured together: the pass is charged to the first of them, and
+// the others show no runs
+struct pipeline_stats
+{
+    std::vector<stage_stats> stages;
+    size_t                   peak_bytes = 0;    // most live at once during a run
+    size_t                   peak_stage = 0;    // the stage that reached it
+};
+
+// how a persistent_pipeline keeps a floating point image between two of
+// its stages: as the stage returned it, as half floats, or as 16-bit
+// integers scaled to the largest magnitude of each row. a stage with a
+// known halo then computes from the narrowed image a band of rows at a
+// time, widened back to the original type, so the full image at full
+// precision never exists between stages
+typedef
+enum { full_precision, half_precision, fixed16_precision }
+intermediate_precision;
+
 struct persistent_pipeline
 {
     persistent_pipeline() {}
     explicit persistent_pipeline(pipeline_fn_t &&fn);
+    explicit persistent_pipeline(pipeline_stage &&stage);
+    explicit persistent_pipeline(cv::Mat (*fn)(cv::Mat const &));
     persistent_pipeline &append(pipeline_fn_t &&fn);
+    persistent_pipeline &append(pipeline_stage &&stage);
+    persistent_pipeline &append(cv::Mat (*fn)(cv::Mat const &));
+    persistent_pipeline &intermediates(intermediate_precision precision);
     cv::Mat operator()(cv::Mat &&image) const;
 
+    // run the pipeline, timing each stage and accounting for the pixel
+    // buffers it allocates. an accounting allocator replaces OpenCV's
+    // default allocator for the run, so allocations made by other threads
+    // in the meantime are counted too
+    cv::Mat operator()(cv::Mat &&image, pipeline_stats &stats) const;
+
+    std::vector<pipeline_stage> const &stages() const
+    {
+        return fn_;
+    }
+
+    intermediate_precision precision() const
+    {
+        return precision_;
+    }
+
   private:
-    std::vector<pipeline_fn_t> fn_;
+    // a crop() moved upstream to run before stages [begin, end), with
+    // its region grown by the halo those stages need
+    struct pushdown
+    {
+        size_t   begin;
+        size_t   end;
+        cv::Rect rect;
+        cv::Size margin;
+    };
+
+    cv::Mat run(cv::Mat &&image, pipeline_stats *stats) const;
+
+    std::vector<pipeline_stage> fn_;
+    std::vector<pushdown>       pushdown_;
+    intermediate_precision      precision_ = full_precision;
 };
 
 }   // namespace opencv_pipeline
@@ -78,4 +241,12 @@ struct persistent_pipeline
 #include "detail.h"
 #include "opencv_pipeline_impl.inl"
 #include "persistent_pipeline.inl"
+#include "stream_scheduler.inl"
+#include "video_recorder.inl"
+#include "pipeline_graph.inl"
+#include "shared_memory.inl"
+#include "mapped_video.inl"
+#include "directory_walk.inl"
+#include "batch_journal.inl"
+#include "async_pipeline.inl"
 #include "detail.inl"
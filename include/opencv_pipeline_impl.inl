@@ -5,7 +5,7 @@ namespace opencv_pipeline {
 inline
 cv::Mat load_image(std::filesystem::path pathname, int flags=cv::IMREAD_COLOR)
 {
-    return cv::imread(pathname.u8string(), flags);
+    return cv::imread(detail::utf8(pathname), flags);
 }
 
 inline
@@ -35,6 +35,9 @@ namespace detail {
 
 // T = cv::KeyPoint           for points
 // T = std::vector<cv::Point> for regions
+//
+// keypoints are detected when they are first needed, so that an extractor
+// that detects them as well can do both in one go
 template<typename T>
 struct feature_detector
 {
@@ -47,23 +50,45 @@ struct feature_detector
     }
 
     cv::Mat operator()(cv::Mat const &img);
+    std::vector<T> const &detected() const;
 
     operator std::vector<T>()
     {
-        return features;
+        return detected();
     }
     
-    cv::Mat        image;
-    std::string    name;
-    std::vector<T> features;
+    cv::Mat                  image;
+    std::string              name;
+    mutable std::vector<T>   features;
+    mutable bool             pending = false;   // features not yet detected in image
+    pyramid_image            pyramid;           // the image's pyramid, if it has one
+    mutable std::vector<int> levels;            // the pyramid level of each feature, if found on one
 };
 
 template<>
 inline
 cv::Mat feature_detector<cv::KeyPoint>::operator()(cv::Mat const &img)
 {
-    image = img;
-    return detail::detect_keypoints(name, features, image);
+    image   = img;
+    pending = true;
+    pyramid = pyramid_image();
+    levels.clear();
+    return image;
+}
+
+template<>
+inline
+std::vector<cv::KeyPoint> const &feature_detector<cv::KeyPoint>::detected() const
+{
+    if (pending)
+    {
+        if (pyramid.levels.empty())
+            detail::detect_keypoints(name, features, image);
+        else
+            detail::detect_keypoints(name, features, levels, pyramid);
+        pending = false;
+    }
+    return features;
 }
 
 template<>
@@ -74,6 +99,20 @@ cv::Mat feature_detector<std::vector<cv::Point>>::operator()(cv::Mat const &img)
     return detail::detect_regions(name, features, image);
 }
 
+template<>
+inline
+std::vector<std::vector<cv::Point>> const &feature_detector<std::vector<cv::Point>>::detected() const
+{
+    return features;
+}
+
+struct limit_t
+{
+    size_t   count;
+    cv::Size grid;
+    bool     anms;
+};
+
 struct feature_extractor
 {
     feature_extractor(std::string name) : name(name)
@@ -92,6 +131,20 @@ keypoints(std::string detector)
     return detail::feature_detector<cv::KeyPoint>(std::move(detector));
 }
 
+// keep at most `count` keypoints, so the cost of describing and matching
+// them has a bound. the budget is shared between the cells of a grid over
+// the keypoints, each keeping its strongest, so they don't all crowd into
+// the busiest part of the image. with `anms`, adaptive non-maximal
+// suppression spreads them further, choosing from the strongest few times
+// the budget
+// e.g. image | keypoints("FAST") | limit(500, cv::Size(8, 6)) | descriptors("ORB");
+inline
+detail::limit_t
+limit(size_t count, cv::Size grid=cv::Size(1, 1), bool anms=false)
+{
+    return { count, grid, anms };
+}
+
 inline
 detail::feature_extractor
 descriptors(std::string extractor)
@@ -106,10 +159,57 @@ detail::feature_detector<cv::KeyPoint> &&operator|(cv::Mat image, detail::featur
     return std::move(detector);
 }
 
+// ORB and BRISK detect on the pyramid's levels instead of building their
+// own, and describe each keypoint on the level it was found on
+// e.g. auto pyr = image | gray | pyramid(4, 1.2);
+//      auto descriptors = pyr | keypoints("ORB") | descriptors("ORB");
+inline
+detail::feature_detector<cv::KeyPoint> &&operator|(pyramid_image const &image, detail::feature_detector<cv::KeyPoint> &&detector)
+{
+    detector(image.levels[0]);
+    detector.pyramid = image;
+    return std::move(detector);
+}
+
+// ORB, BRISK, KAZE, AKAZE and SIFT detect and describe keypoints from one
+// scale space, which is built once when both come from the same algorithm
 inline
 cv::Mat operator|(detail::feature_detector<cv::KeyPoint> const &detector, detail::feature_extractor const &extractor)
 {
-    return detail::extract_keypoints(extractor.name, detector.features, detector.image);
+    cv::Mat descriptors;
+    if (detector.pending  &&  detector.pyramid.levels.empty()
+    &&  detail::detect_and_extract(detector.name, extractor.name, detector.features, descriptors, detector.image))
+    {
+        detector.pending = false;
+        return descriptors;
+    }
+
+    auto const &features = detector.detected();
+    if (!detector.levels.empty())
+        return detail::extract_keypoints(extractor.name, features, detector.levels, detector.pyramid);
+    return detail::extract_keypoints(extractor.name, features, detector.image);
+}
+
+// the keypoints kept from a pyramid keep their levels
+inline
+detail::feature_detector<cv::KeyPoint> operator|(detail::feature_detector<cv::KeyPoint> const &detector, detail::limit_t const &limit)
+{
+    auto const &features = detector.detected();
+    detail::feature_detector<cv::KeyPoint> limited(detector.image, {});
+    limited.pyramid = detector.pyramid;
+    for (auto const i : detail::limit_indices(features, limit.count, limit.grid, limit.anms))
+    {
+        limited.features.push_back(features[i]);
+        if (!detector.levels.empty())
+            limited.levels.push_back(detector.levels[i]);
+    }
+    return limited;
+}
+
+inline
+std::vector<cv::KeyPoint> operator|(std::vector<cv::KeyPoint> const &keypoints, detail::limit_t const &limit)
+{
+    return detail::limit_keypoints(keypoints, limit.count, limit.grid, limit.anms);
 }
 
 inline
@@ -130,7 +230,7 @@ detail::feature_detector<cv::KeyPoint> operator|(std::vector<cv::KeyPoint> const
 inline
 std::vector<cv::KeyPoint> operator|(detail::feature_detector<cv::KeyPoint> const &detector, pipeline_terminator)
 {
-    return detector.features;
+    return detector.detected();
 }
 
 inline
@@ -185,6 +285,40 @@ foreach(C const &container, std::function<cv::Mat (cv::Mat, int, typename C::val
         std::cref(container), rhs);
 }
 
+// run `fn` for every item of the container concurrently, each reading the
+// same image, then fold the results into the image in container order with
+// `reduce` so the outcome does not depend on scheduling
+//    fn:     R       (cv::Mat const &image, int index, value_type const &value)
+//    reduce: cv::Mat (cv::Mat image, int index, R result)
+template<typename C, typename Fn, typename Reduce>
+inline
+pipeline_fn_t
+parallel_foreach(C const &container, Fn fn, Reduce reduce)
+{
+    using value_t  = typename C::value_type;
+    using result_t = std::decay_t<std::invoke_result_t<Fn, cv::Mat const &, int, value_t const &>>;
+    return std::bind(
+        [](cv::Mat const &image, auto const &container, Fn const &fn, Reduce const &reduce) -> cv::Mat
+        {
+            std::vector<value_t const *> items;
+            for (auto const &value : container)
+                items.push_back(&value);
+
+            std::vector<std::optional<result_t>> results(items.size());
+            cv::parallel_for_(cv::Range(0, int(items.size())), [&](cv::Range const &range) {
+                for (int index=range.start; index<range.end; ++index)
+                    results[index].emplace(fn(image, index, *items[index]));
+            });
+
+            cv::Mat result = image;
+            for (int index=0; index<int(results.size()); ++index)
+                result = reduce(result, index, std::move(*results[index]));
+            return result;
+        },
+        std::placeholders::_1,
+        std::cref(container), fn, reduce);
+}
+
 
 // enable early pipeline to detect features without extracting descriptors
 // e.g. auto kps = test_file | load | gray_bgr | features("HARRIS") | end;
@@ -222,6 +356,29 @@ cv::Mat operator|(cv::Mat const &left, pipeline_fn_t const &right)
     return right(left);
 }
 
+// a temporary image is not needed after the function, so the built-in
+// functions that can work in place overwrite it when it is not shared
+inline
+cv::Mat operator|(cv::Mat &&left, cv::Mat(*right)(cv::Mat const &))
+{
+    auto const builtin = detail::find_builtin(right);
+    if (builtin  &&  builtin->inplace  &&  detail::sole_owner(left)  &&  builtin->inplace(left))
+        return std::move(left);
+    return right(left);
+}
+
+inline
+cv::Mat operator|(cv::Mat &&left, pipeline_fn_t const &right)
+{
+    return right(left);
+}
+
+inline
+cv::Mat operator|(cv::Mat &&left, pipeline_stage const &right)
+{
+    return right(std::move(left));
+}
+
 // some OpenCV functions return MatExpr
 inline
 cv::Mat operator|(cv::Mat const &left, cv::MatExpr(*right)(cv::Mat const &))
@@ -234,43 +391,84 @@ cv::Mat operator|(cv::Mat const &left, cv::MatExpr(*right)(cv::Mat const &))
 //
 
 inline
-pipeline_fn_t
+pipeline_stage
 color_space(int code)
 {
     using namespace std::placeholders;
-    return std::bind(detail::color_space, _1, code);
+    pipeline_stage stage(
+        std::bind(detail::color_space, _1, code),
+        detail::color_space_halo(code),
+        detail::signature("color_space", code));
+    if (code == cv::COLOR_BGR2GRAY)
+        stage.pointwise = { {detail::pointwise_op::bgr2gray} };
+    else if (code == cv::COLOR_GRAY2BGR)
+        stage.pointwise = { {detail::pointwise_op::gray2bgr} };
+    return stage;
 }
 
 inline
-pipeline_fn_t
+pipeline_stage
 convert(int type, double alpha=1.0, double beta=0.0)
 {
     using namespace std::placeholders;
-    return std::bind(detail::convert, _1, type, alpha, beta);
+    pipeline_stage stage(
+        std::bind(detail::convert, _1, type, alpha, beta),
+        cv::Size(),
+        detail::signature("convert", type, alpha, beta));
+    stage.inplace   = std::bind(detail::convert_inplace, _1, type, alpha, beta);
+    stage.pointwise = { {detail::pointwise_op::convert, type, alpha, beta} };
+    return stage;
 }
 
+// keep the region `rect` of the image, clipped to the image. in a
+// persistent_pipeline, the crop is moved upstream through the stages
+// that have a known halo, so they only compute the region consumed
 inline
-pipeline_fn_t
-dilate(int dx, int dy)
+pipeline_stage
+crop(cv::Rect rect)
 {
     using namespace std::placeholders;
-    return std::bind(detail::dilate, _1, dx, dy);
+    pipeline_stage stage(
+        std::bind(detail::crop, _1, rect),
+        pipeline_stage::opaque(),
+        detail::signature("crop", rect.x, rect.y, rect.width, rect.height));
+    stage.crop = rect;
+    return stage;
 }
 
 inline
-pipeline_fn_t
-erode(int dx, int dy)
+pipeline_stage
+dilate(int dx, int dy, int shape=cv::MORPH_RECT)
 {
+    // the structuring element is built once, with the stage
     using namespace std::placeholders;
-    return std::bind(detail::erode, _1, dx, dy);
+    return pipeline_stage(
+        std::bind(detail::dilate, _1, cv::getStructuringElement(shape, cv::Size(dx, dy)), shape),
+        detail::kernel_halo(dx, dy),
+        detail::signature("dilate", dx, dy, shape));
 }
 
 inline
-pipeline_fn_t
+pipeline_stage
+erode(int dx, int dy, int shape=cv::MORPH_RECT)
+{
+    // the structuring element is built once, with the stage
+    using namespace std::placeholders;
+    return pipeline_stage(
+        std::bind(detail::erode, _1, cv::getStructuringElement(shape, cv::Size(dx, dy)), shape),
+        detail::kernel_halo(dx, dy),
+        detail::signature("erode", dx, dy, shape));
+}
+
+inline
+pipeline_stage
 gaussian_blur(int dx, int dy, double sigmaX=0.0, double sigmaY=0.0, int border=cv::BORDER_DEFAULT)
 {
     using namespace std::placeholders;
-    return std::bind(detail::gaussian_blur, _1, dx, dy, sigmaX, sigmaY, border);
+    return pipeline_stage(
+        std::bind(detail::gaussian_blur, _1, dx, dy, sigmaX, sigmaY, border),
+        detail::gaussian_halo(dx, dy, sigmaX, sigmaY),
+        detail::signature("gaussian_blur", dx, dy, sigmaX, sigmaY, border));
 }
 
 inline
@@ -299,6 +497,25 @@ cv::Mat gray_bgr(cv::Mat const &image)
     return image | gray | color_space(cv::COLOR_GRAY2BGR);
 }
 
+// map each value of an 8-bit image through a table of 256 entries, as
+// cv::LUT. the table is identified by its data, as its entries may change,
+// and across runs, as by a journal, by its entries when they are read
+inline
+pipeline_stage
+lut(cv::Mat const &table)
+{
+    using namespace std::placeholders;
+    pipeline_stage stage(
+        std::bind(detail::lut, _1, table),
+        cv::Size(),
+        detail::signature("lut", static_cast<void const *>(table.data), table.type()));
+    stage.pointwise = { {detail::pointwise_op::lut, 0, 1., 0., table} };
+    stage.stable_signature = [table] {
+        return detail::signature("lut", detail::pixel_hash(table), table.type());
+    };
+    return stage;
+}
+
 inline
 cv::Mat mirror(cv::Mat const &image)
 {
@@ -308,7 +525,7 @@ cv::Mat mirror(cv::Mat const &image)
 }
 
 inline
-pipeline_fn_t
+pipeline_stage
 resize(double fx, double fy, int interpolation)
 {
     auto resizer = [fx, fy, interpolation](cv::Mat const &src) -> cv::Mat {
@@ -317,32 +534,115 @@ resize(double fx, double fy, int interpolation)
         return dst;
     };
 
+    // shrinking an image with a pyramid starts from its smallest level
+    // still at least the size of the result. nearest neighbour keeps to
+    // the image's own pixels
+    auto from_pyramid = [fx, fy, interpolation, resizer](pyramid_image const &src) -> cv::Mat {
+        auto const &image = src.levels[0];
+        if (fx >= 1.  ||  fy >= 1.  ||  interpolation == cv::INTER_NEAREST)
+            return resizer(image);
+
+        cv::Mat dst;
+        cv::Size const size(cv::saturate_cast<int>(image.cols * fx), cv::saturate_cast<int>(image.rows * fy));
+        cv::resize(detail::pyramid_level(src, size), dst, size, 0, 0, interpolation);
+        return dst;
+    };
+
     using namespace std::placeholders;
-    return std::bind(resizer, _1);
+    pipeline_stage stage(
+        std::bind(resizer, _1),
+        pipeline_stage::opaque(),
+        detail::signature("resize", fx, fy, interpolation));
+    stage.from_pyramid = from_pyramid;
+    return stage;
+}
+
+namespace detail {
+
+struct pyramid_t
+{
+    int    levels;
+    double scale;
+};
+
+}   // namespace detail
+
+// build a pyramid of `levels` images, each `scale` times smaller than the
+// one before, once for the stages that use it: shrinking resize() stages
+// start from the nearest level, and keypoints("ORB") and keypoints("BRISK")
+// detect on its levels instead of building their own. other stages run on
+// the image itself
+// e.g. auto pyr = image | gray | pyramid(4, 1.2);
+//      auto kps  = pyr | keypoints("ORB") | end;
+//      auto half = pyr | resize(.4, .4, cv::INTER_AREA);
+inline
+detail::pyramid_t
+pyramid(int levels, double scale=2.)
+{
+    if (levels < 1  ||  scale <= 1.)
+        throw std::invalid_argument("a pyramid needs a level and a scale greater than 1");
+    return { levels, scale };
 }
 
 inline
-pipeline_fn_t
+pyramid_image operator|(cv::Mat const &image, detail::pyramid_t const &pyramid)
+{
+    return detail::build_pyramid(image, pyramid.levels, pyramid.scale);
+}
+
+inline
+cv::Mat operator|(pyramid_image const &image, pipeline_stage const &stage)
+{
+    return stage.from_pyramid? stage.from_pyramid(image) : stage(image.levels[0]);
+}
+
+inline
+pipeline_stage
 sobel(int dx, int dy, int ksize=3, double scale=1, double delta=0, int border=cv::BORDER_DEFAULT)
 {
+    // ksize 1 and Scharr (-1) still read a 3-pixel neighbourhood
     using namespace std::placeholders;
-    return std::bind(detail::sobel, _1, dx, dy, ksize, scale, delta, border);
+    return pipeline_stage(
+        std::bind(detail::sobel, _1, dx, dy, ksize, scale, delta, border),
+        detail::kernel_halo(std::max(ksize, 3), std::max(ksize, 3)),
+        detail::signature("sobel", dx, dy, ksize, scale, delta, border));
 }
 
 inline
-pipeline_fn_t
+pipeline_stage
 subtract(cv::Mat const &other)
 {
+    // the other image is identified by its data, as its pixels may change,
+    // and across runs by its pixels when they are read
     using namespace std::placeholders;
-    return std::bind(detail::subtract, _1, other);
+    pipeline_stage stage(
+        std::bind(detail::subtract, _1, other),
+        pipeline_stage::opaque(),
+        detail::signature("subtract", static_cast<void const *>(other.data), other.rows, other.cols, other.type(), other.step[0]));
+    stage.pointwise = { {detail::pointwise_op::subtract, 0, 1., 0., other} };
+    stage.stable_signature = [other] {
+        return detail::signature("subtract", detail::pixel_hash(other), other.rows, other.cols, other.type());
+    };
+    return stage;
 }
 
 inline
-pipeline_fn_t
+pipeline_stage
 threshold(double thresh, double maxval, int type=CV_THRESH_BINARY | CV_THRESH_OTSU)
 {
+    // automatic thresholds are computed from the whole image
     using namespace std::placeholders;
-    return std::bind(detail::threshold, _1, thresh, maxval, type);
+    bool const automatic = (type & (cv::THRESH_OTSU | cv::THRESH_TRIANGLE)) != 0;
+    pipeline_stage stage(
+        std::bind(detail::threshold, _1, thresh, maxval, type),
+        automatic? pipeline_stage::opaque() : cv::Size(),
+        detail::signature("threshold", thresh, maxval, type));
+    stage.inplace = [thresh, maxval, type](cv::Mat &image) {
+        cv::threshold(image, image, thresh, maxval, type);
+        return true;
+    };
+    stage.pointwise = { {detail::pointwise_op::threshold, type, thresh, maxval} };
+    return stage;
 }
 
 
@@ -396,6 +696,14 @@ if_(bool const cond, pipeline_fn_t if_fn, pipeline_fn_t else_fn=reset)
     return cond? if_fn : else_fn;
 }
 
+inline
+pipeline_fn_t
+if_(std::function<bool const (cv::Mat const &)> cond, pipeline_fn_t if_fn, pipeline_fn_t else_fn)
+{
+    using namespace std::placeholders;
+    return std::bind(detail::if_else, _1, cond, if_fn, else_fn);
+}
+
 inline
 persistent_pipeline
 if_(bool const cond,
@@ -405,6 +713,32 @@ if_(bool const cond,
     return cond? if_pipeline : else_pipeline;
 }
 
+// run `fn` only when the image differs from the last one it processed by
+// more than a mean absolute `threshold` per pixel, measured on a 32x32
+// thumbnail. otherwise re-emit the last result. for video from a static
+// camera, this skips an expensive pipeline on frames where nothing happens.
+// the last image is the reference for the next, so one if_changed() serves
+// one stream: it is safe to call from several threads, but they take turns,
+// and frames from different cameras would be compared with each other.
+// make one per stream instead
+inline
+pipeline_fn_t
+if_changed(double threshold, pipeline_fn_t fn)
+{
+    using namespace std::placeholders;
+    auto gate = std::make_shared<detail::change_gate>(threshold);
+    return std::bind(detail::if_changed, _1, fn, gate);
+}
+
+inline
+pipeline_fn_t
+if_changed(double threshold, persistent_pipeline pipeline)
+{
+    return if_changed(threshold, [pipeline](cv::Mat const &image) {
+        return pipeline(cv::Mat(image));
+    });
+}
+
 
 //
 // image attributes
@@ -421,6 +755,396 @@ channels(int num)
 
 
 
+namespace detail {
+
+// scales frames down while processing them takes longer than the frame
+// budget, and back up once the cost at the larger size would fit again
+class resolution_controller
+{
+  public:
+    using duration = std::chrono::duration<double>;
+
+    resolution_controller(duration budget, double min_scale, double step)
+      : budget_(budget), min_scale_(min_scale), step_(step)
+    {
+    }
+
+    double scale() const
+    {
+        return scale_.load();
+    }
+
+    void update(duration elapsed)
+    {
+        // exponentially weighted average of the per-frame processing time
+        average_ = (average_.count() == 0.)? elapsed : average_ + (elapsed - average_) / 8.;
+
+        if (average_ > budget_ * 1.05  &&  scale_ > min_scale_)
+        {
+            rescale(std::max(min_scale_, scale_ * step_));
+            return;
+        }
+
+        // scaling up costs 1/step^2, so only do it when there would still be
+        // headroom afterwards, and it has been the case for a while
+        auto const predicted = average_ / (step_ * step_);
+        if (scale_ < 1.  &&  predicted < budget_ * 0.9)
+        {
+            if (++headroom_ == settle_frames)
+                rescale(std::min(1., scale_ / step_));
+        }
+        else
+            headroom_ = 0;
+    }
+
+  private:
+    void rescale(double scale)
+    {
+        // processing time is proportional to the number of pixels
+        average_ *= (scale * scale) / (scale_ * scale_);
+        scale_    = scale;
+        headroom_ = 0;
+    }
+
+    static int const settle_frames = 30;
+
+    duration const      budget_;
+    double   const      min_scale_;
+    double   const      step_;
+    std::atomic<double> scale_{1.};     // read by the capturing thread
+    duration            average_  = duration::zero();
+    int                 headroom_ = 0;
+};
+
+}   // namespace detail
+
+// throughput and latency of a video_pipeline
+struct video_metrics
+{
+    using milliseconds = std::chrono::duration<double, std::milli>;
+
+    size_t       captured  = 0;     // frames read from the source
+    size_t       processed = 0;     // frames that reached the end of the pipeline
+    size_t       dropped   = 0;     // frames discarded by a stage
+    double       fps       = 0.;    // processed over the last second
+    milliseconds latency_p50;       // capture to end of pipeline, over
+    milliseconds latency_p95;       // the most recent frames
+    milliseconds latency_p99;
+};
+
+namespace detail {
+
+// the last `N` values of a measurement, for percentiles over recent
+// history. once full, each new value replaces the oldest
+template<typename T, size_t N>
+class recent_values
+{
+  public:
+    void add(T value)
+    {
+        if (values_.size() < N)
+            values_.push_back(value);
+        else
+            values_[added_ % N] = value;
+        ++added_;
+    }
+
+    std::vector<T> const &values() const
+    {
+        return values_;
+    }
+
+  private:
+    std::vector<T> values_;
+    size_t         added_ = 0;
+};
+
+// records video_pipeline metrics on the thread running the pipeline, for
+// querying from any thread
+class metrics_recorder
+{
+  public:
+    using clock       = std::chrono::steady_clock;
+    using report_fn_t = std::function<void (video_metrics const &)>;
+
+    void captured()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++metrics_.captured;
+    }
+
+    void dropped()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++metrics_.dropped;
+        report(lock, clock::now());
+    }
+
+    void processed(clock::time_point captured_at)
+    {
+        auto const now = clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++metrics_.processed;
+        latencies_.add(now - captured_at);
+
+        completions_.push_back(now);
+        while (now - completions_.front() > std::chrono::seconds(1))
+            completions_.pop_front();
+
+        report(lock, now);
+    }
+
+    void report_every(clock::duration interval, report_fn_t fn)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        report_interval_ = interval;
+        report_fn_       = fn;
+        last_report_     = clock::now();
+    }
+
+    video_metrics snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return snapshot_locked();
+    }
+
+  private:
+    video_metrics snapshot_locked() const
+    {
+        video_metrics metrics = metrics_;
+        if (completions_.size() > 1)
+        {
+            std::chrono::duration<double> const span = completions_.back() - completions_.front();
+            metrics.fps = (completions_.size() - 1) / span.count();
+        }
+
+        if (!latencies_.values().empty())
+        {
+            auto sorted = latencies_.values();
+            auto percentile = [&sorted](double p) -> video_metrics::milliseconds {
+                auto const nth = sorted.begin() + size_t(p * (sorted.size() - 1));
+                std::nth_element(sorted.begin(), nth, sorted.end());
+                return *nth;
+            };
+            metrics.latency_p50 = percentile(0.50);
+            metrics.latency_p95 = percentile(0.95);
+            metrics.latency_p99 = percentile(0.99);
+        }
+        return metrics;
+    }
+
+    // call the report function outside of the lock, so it can take its time
+    void report(std::unique_lock<std::mutex> &lock, clock::time_point now)
+    {
+        if (!report_fn_  ||  now - last_report_ < report_interval_)
+            return;
+
+        last_report_ = now;
+        auto const metrics = snapshot_locked();
+        auto const fn      = report_fn_;
+        lock.unlock();
+        fn(metrics);
+    }
+
+    mutable std::mutex                            mutex_;
+    video_metrics                                 metrics_;
+    recent_values<clock::duration, 1024>          latencies_;
+    std::deque<clock::time_point>                 completions_;
+    report_fn_t                                   report_fn_;
+    clock::duration                               report_interval_;
+    clock::time_point                             last_report_;
+};
+
+}   // namespace detail
+
+namespace detail {
+
+// a block of memory that a frame_arena allocates from by bumping an
+// offset. the last of the arena and the buffers in it to let go frees it
+struct arena_region
+{
+    explicit arena_region(size_t capacity)
+      : memory(static_cast<uchar *>(cv::fastMalloc(capacity))), capacity(capacity)
+    {
+    }
+
+    ~arena_region()
+    {
+        cv::fastFree(memory);
+    }
+
+    static void release(arena_region *region)
+    {
+        if (--region->refs == 0)
+            delete region;
+    }
+
+    uchar *const        memory;
+    size_t const        capacity;
+    size_t              offset = 0;
+    std::atomic<size_t> refs{1};    // the arena's, and one per buffer
+};
+
+// serves the Mat allocations made on a thread while it plays a frame.
+// allocating is bumping an offset, and at the end of the frame the region
+// is rewound if every buffer in it has been released. buffers that
+// outlive the frame, e.g. a copy kept by a stage, keep their region alive
+// and the arena carries on in a new one. allocations that don't fit, and
+// those made on OpenCV's worker threads, go to the default allocator
+class frame_arena
+{
+  public:
+    explicit frame_arena(size_t capacity);
+    ~frame_arena();
+
+    frame_arena(frame_arena const &)            = delete;
+    frame_arena &operator=(frame_arena const &) = delete;
+
+    // the arena serving the calling thread, if any
+    static frame_arena *&current()
+    {
+        thread_local frame_arena *arena = nullptr;
+        return arena;
+    }
+
+    // `size` bytes in the current region, or nullptr if it is full
+    uchar *allocate(size_t size, arena_region *&region)
+    {
+        auto const offset = cv::alignSize(region_->offset, 64);
+        if (offset + size > region_->capacity)
+            return nullptr;
+
+        region_->offset = offset + size;
+        ++region_->refs;
+        region = region_;
+        return region_->memory + offset;
+    }
+
+    void reset()
+    {
+        if (region_->refs == 1)
+            region_->offset = 0;
+        else
+        {
+            arena_region::release(region_);
+            region_ = new arena_region(capacity_);
+        }
+    }
+
+  private:
+    size_t const  capacity_;
+    arena_region *region_;
+};
+
+#if CV_MAJOR_VERSION==2
+
+// OpenCV 2 has no replaceable default allocator, so frames are allocated
+// as usual
+inline frame_arena::frame_arena(size_t capacity) : capacity_(capacity), region_(new arena_region(0)) {}
+inline frame_arena::~frame_arena() { arena_region::release(region_); }
+
+#else
+
+// serves the calling thread's arena, installed while any arena exists
+class arena_allocator : public stacked_allocator
+{
+  public:
+    static arena_allocator &instance()
+    {
+        static auto *const allocator = new arena_allocator();
+        return *allocator;
+    }
+
+    cv::UMatData *allocate(int dims, int const *sizes, int type, void *data, size_t *step, access_flags flags, cv::UMatUsageFlags usage) const override
+    {
+        auto const arena = frame_arena::current();
+        if (!arena  ||  data)
+            return inner()->allocate(dims, sizes, type, data, step, flags, usage);
+
+        // continuous, as the standard allocator lays them out
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; --i)
+        {
+            if (step)
+                step[i] = total;
+            total *= size_t(sizes[i]);
+        }
+
+        arena_region *region = nullptr;
+        auto const memory = arena->allocate(total, region);
+        if (!memory)
+            return inner()->allocate(dims, sizes, type, data, step, flags, usage);
+
+        auto const u = new cv::UMatData(this);
+        u->data     = u->origdata = memory;
+        u->size     = total;
+        u->userdata = region;
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, access_flags, cv::UMatUsageFlags) const override
+    {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData *u) const override
+    {
+        if (!u)
+            return;
+
+        arena_region::release(static_cast<arena_region *>(u->userdata));
+        delete u;
+    }
+
+  private:
+    arena_allocator() = default;
+};
+
+inline
+frame_arena::frame_arena(size_t capacity) : capacity_(capacity), region_(new arena_region(capacity))
+{
+    arena_allocator::instance().install(true);
+}
+
+inline
+frame_arena::~frame_arena()
+{
+    arena_allocator::instance().install(false);
+    arena_region::release(region_);
+}
+
+#endif
+
+// a frame played with its arena serving the thread's allocations, which
+// is reset when the frame has reached the sink
+class frame_scope
+{
+  public:
+    explicit frame_scope(frame_arena *arena) : arena_(arena)
+    {
+        if (arena_)
+            frame_arena::current() = arena_;
+    }
+
+    ~frame_scope()
+    {
+        if (arena_)
+        {
+            frame_arena::current() = nullptr;
+            arena_->reset();
+        }
+    }
+
+    frame_scope(frame_scope const &)            = delete;
+    frame_scope &operator=(frame_scope const &) = delete;
+
+  private:
+    frame_arena *const arena_;
+};
+
+}   // namespace detail
+
 class video_pipeline
 {
   public:
@@ -434,8 +1158,16 @@ class video_pipeline
 
     video_pipeline(std::filesystem::path pathname)
     {
-       if (!capture_.open(pathname.u8string()))
-            last_error_ = "Unable to open video file: " + pathname.u8string();
+       if (!capture_.open(detail::utf8(pathname)))
+            last_error_ = "Unable to open video file: " + detail::utf8(pathname);
+    }
+
+    // frames from a function rather than a cv::VideoCapture. the function
+    // returns an empty image at the end of the video. an empty function
+    // is a source that failed to open, for the reason in `error`
+    video_pipeline(std::function<cv::Mat ()> source, std::string error)
+      : last_error_(std::move(error)), source_(std::move(source))
+    {
     }
 
     std::string last_error() const
@@ -445,26 +1177,123 @@ class video_pipeline
 
     bool open() const
     {
-        return capture_.isOpened();
+        return source_? true : capture_.isOpened();
     }
 
     cv::Mat next_frame()
     {
         cv::Mat image;
-        capture_ >> image;
+        if (source_)
+            image = source_();
+        else
+            capture_ >> image;
         if (image.empty())
             throw exceptions::end_of_file();
+
+        frame_start_ = std::chrono::steady_clock::now();
+        metrics_->captured();
+        if (scale() < 1.)
+            cv::resize(image, image, cv::Size(), scale(), scale(), cv::INTER_AREA);
         return image;
     }
 
+    // called when a frame has been through the whole pipeline
+    void frame_done()
+    {
+        frame_done(frame_start_);
+    }
+
+    // called when a frame captured at `captured_at` has been through the
+    // whole pipeline, for frames that have been queued after capture
+    void frame_done(std::chrono::steady_clock::time_point captured_at)
+    {
+        if (controller_)
+            controller_->update(std::chrono::steady_clock::now() - captured_at);
+        metrics_->processed(captured_at);
+    }
+
+    // called when a stage has dropped the frame
+    void frame_dropped()
+    {
+        metrics_->dropped();
+    }
+
+    // frame counts, rolling frame rate and latency percentiles. safe to
+    // call from any thread while the pipeline is playing
+    video_metrics metrics() const
+    {
+        return metrics_->snapshot();
+    }
+
+    // call `fn` with the metrics, at most every `interval`, from the thread
+    // playing the pipeline
+    template<typename Rep, typename Period>
+    video_pipeline &report(
+        std::chrono::duration<Rep, Period>              interval,
+        std::function<void (video_metrics const &)> fn)
+    {
+        metrics_->report_every(
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval), fn);
+        return *this;
+    }
+
+    // scale frames down before the pipeline while processing them takes
+    // longer than `budget`, by `step` at a time but not below `min_scale`
+    video_pipeline &adapt_resolution(
+        std::chrono::duration<double> budget,
+        double min_scale=0.25,
+        double step=0.8)
+    {
+        controller_ = std::make_unique<detail::resolution_controller>(budget, min_scale, step);
+        return *this;
+    }
+
+    // scale of the frames passed to the pipeline, relative to the capture
+    double scale() const
+    {
+        return controller_? controller_->scale() : 1.;
+    }
+
+    // map coordinates in a pipeline frame back to the capture resolution
+    cv::Point2f to_full_resolution(cv::Point2f const &point) const
+    {
+        return cv::Point2f(float(point.x / scale()), float(point.y / scale()));
+    }
+
+    cv::Rect to_full_resolution(cv::Rect const &rect) const
+    {
+        return cv::Rect(
+            cv::Point(cvRound(rect.x / scale()), cvRound(rect.y / scale())),
+            cv::Size(cvRound(rect.width / scale()), cvRound(rect.height / scale())));
+    }
+
+    // serve the allocations made while `play` captures and processes a
+    // frame from an arena of `capacity` bytes, rewound when the frame has
+    // reached the sink, rather than from the heap
+    video_pipeline &use_arena(size_t capacity=size_t(64) << 20)
+    {
+        arena_ = std::make_unique<detail::frame_arena>(capacity);
+        return *this;
+    }
+
+    detail::frame_arena *arena() const
+    {
+        return arena_.get();
+    }
+
     video_pipeline()                                  = delete;
     video_pipeline(video_pipeline const &)            = delete;
     video_pipeline &operator=(video_pipeline &&)      = delete;
     video_pipeline &operator=(video_pipeline const &) = delete;
 
   private:
-    cv::VideoCapture capture_;
-    std::string      last_error_;
+    cv::VideoCapture                               capture_;
+    std::string                                    last_error_;
+    std::function<cv::Mat ()>                      source_;
+    std::unique_ptr<detail::resolution_controller> controller_;
+    std::chrono::steady_clock::time_point          frame_start_;
+    std::unique_ptr<detail::metrics_recorder>      metrics_ = std::make_unique<detail::metrics_recorder>();
+    std::unique_ptr<detail::frame_arena>           arena_;
 };
 
 // capture video from a file
@@ -544,6 +1373,22 @@ cv::Mat next_frame(std::pair<LHS, RHS> chain)
     return chain.second(next_frame(chain.first));
 }
 
+namespace detail {
+
+inline
+video_pipeline &video_source(video_pipeline &pipeline)
+{
+    return pipeline;
+}
+
+template<typename LHS, typename RHS>
+video_pipeline &video_source(std::pair<LHS, RHS> &chain)
+{
+    return video_source(chain.first);
+}
+
+}   // namespace detail
+
 #pragma warning(push)
 #pragma warning(disable: 4127)  // C4127 conditional expression is constant
 template<typename LHS, typename RHS>
@@ -552,8 +1397,20 @@ operator|(std::pair<LHS, RHS> lhs, video_pipeline_terminator)
 {
     try
     {
+        auto &source = detail::video_source(lhs);
         while (1)
-            next_frame(lhs);
+        {
+            detail::frame_scope const frame(source.arena());
+            try
+            {
+                next_frame(lhs);
+                source.frame_done();
+            }
+            catch (exceptions::frame_dropped &)
+            {
+                source.frame_dropped();
+            }
+        }
     }
     catch (exceptions::end_of_file &)
     {
@@ -6,25 +6,306 @@ typedef
 enum { pipeline=1, apply }
 delay_result;
 
+namespace detail {
+
+// the footprint, identity, in place variant and fusable operations of
+// the built-in stages that are plain functions
+inline
+builtin_stage const *find_builtin(cv::Mat (*fn)(cv::Mat const &))
+{
+    static builtin_stage const builtins[] = {
+        { gray,         "gray",         true,  nullptr, { {pointwise_op::bgr2gray} } },
+        { gray_bgr,     "gray_bgr",     true,  nullptr, { {pointwise_op::bgr2gray}, {pointwise_op::gray2bgr} } },
+        { clone,        "clone",        true,  nullptr, {} },
+        { reset,        "reset",        true,  nullptr, {} },
+        { verify,       "verify",       true,  nullptr, {} },
+        { mirror,       "mirror",       false, [](cv::Mat &image) { cv::flip(image, image, 1);      return true; }, {} },
+        { equalizeHist, "equalizeHist", false, [](cv::Mat &image) { cv::equalizeHist(image, image); return true; }, {} },
+    };
+
+    for (auto const &builtin : builtins)
+    {
+        if (builtin.fn == fn)
+            return &builtin;
+    }
+    return nullptr;
+}
+
+inline
+pipeline_stage make_stage(cv::Mat (*fn)(cv::Mat const &))
+{
+    auto const builtin = find_builtin(fn);
+    if (!builtin)
+        return pipeline_stage(fn);
+
+    pipeline_stage stage(fn, builtin->pointwise? cv::Size() : pipeline_stage::opaque(), signature(builtin->name));
+    if (builtin->inplace)
+        stage.inplace = builtin->inplace;
+    stage.pointwise = builtin->ops;
+    return stage;
+}
+
+}   // namespace detail
+
+inline
+cv::Mat pipeline_stage::operator()(cv::Mat &&image) const
+{
+    if (inplace  &&  detail::sole_owner(image)  &&  inplace(image))
+        return std::move(image);
+    return pipeline_fn_t::operator()(image);
+}
+
 inline
 persistent_pipeline::persistent_pipeline(pipeline_fn_t &&fn)
 {
-    fn_.push_back(std::forward<pipeline_fn_t>(fn));
+    append(std::forward<pipeline_fn_t>(fn));
+}
+
+inline
+persistent_pipeline::persistent_pipeline(pipeline_stage &&stage)
+{
+    append(std::forward<pipeline_stage>(stage));
+}
+
+inline
+persistent_pipeline::persistent_pipeline(cv::Mat (*fn)(cv::Mat const &))
+{
+    append(fn);
 }
 
 inline
 persistent_pipeline &persistent_pipeline::append(pipeline_fn_t &&fn)
 {
-    fn_.push_back(std::forward<pipeline_fn_t>(fn));
+    return append(pipeline_stage(std::forward<pipeline_fn_t>(fn)));
+}
+
+inline
+persistent_pipeline &persistent_pipeline::append(cv::Mat (*fn)(cv::Mat const &))
+{
+    return append(detail::make_stage(fn));
+}
+
+inline
+persistent_pipeline &persistent_pipeline::append(pipeline_stage &&stage)
+{
+    if (stage.crop)
+    {
+        // move the crop upstream past the stages that have a known halo,
+        // growing the region it needs from them on the way
+        cv::Size margin;
+        size_t   begin = fn_.size();
+        while (begin > 0  &&  fn_[begin-1].local())
+        {
+            --begin;
+            margin.width  += fn_[begin].halo.width;
+            margin.height += fn_[begin].halo.height;
+        }
+
+        if (begin < fn_.size())
+            pushdown_.push_back({begin, fn_.size(), *stage.crop, margin});
+    }
+
+    fn_.push_back(std::forward<pipeline_stage>(stage));
+    return *this;
+}
+
+inline
+persistent_pipeline &persistent_pipeline::intermediates(intermediate_precision precision)
+{
+    precision_ = precision;
     return *this;
 }
 
 inline
 cv::Mat persistent_pipeline::operator()(cv::Mat &&image) const
 {
-    for (auto &fn : fn_)
-        image = fn(image);
-    return image;
+    return run(std::move(image), nullptr);
+}
+
+inline
+cv::Mat persistent_pipeline::operator()(cv::Mat &&image, pipeline_stats &stats) const
+{
+    struct accounting
+    {
+        accounting()  { detail::account_allocations(true);  }
+        ~accounting() { detail::account_allocations(false); }
+    } const scope;
+
+    if (stats.stages.size() != fn_.size())
+    {
+        stats.stages.assign(fn_.size(), stage_stats());
+        for (size_t i=0; i<fn_.size(); ++i)
+            stats.stages[i].name = fn_[i].signature.empty()? "#" + std::to_string(i) : fn_[i].signature;
+    }
+    return run(std::move(image), &stats);
+}
+
+inline
+cv::Mat persistent_pipeline::run(cv::Mat &&image, pipeline_stats *stats) const
+{
+    // run stages [first, last): a single stage, or a run of pointwise
+    // stages fused into one pass over the image. a run is accounted to its
+    // first stage, and falls back to its stages one at a time when the
+    // image's type is not one the fused pass reproduces exactly
+    auto const execute = [this](size_t first, size_t last, cv::Mat &&input) -> cv::Mat {
+        if (last - first == 1)
+            return fn_[first](std::move(input));
+
+        std::vector<detail::pointwise_op const *> ops;
+        for (auto stage=first; stage<last; ++stage)
+        {
+            for (auto const &op : fn_[stage].pointwise)
+                ops.push_back(&op);
+        }
+        if (detail::run_fused(input, ops))
+            return std::move(input);
+
+        for (auto stage=first; stage<last; ++stage)
+            input = fn_[stage](std::move(input));
+        return std::move(input);
+    };
+
+    // run stages [first, last) on an image held at reduced precision. a
+    // stage with a known halo runs a band of rows at a time, widened with
+    // the rows its halo reads, which absorb the effects of the band's
+    // edges as a crop's margin does. the result is assembled a band at a
+    // time too, narrowed if another stage consumes it
+    auto const execute_narrowed = [this, &execute](size_t first, size_t last, detail::narrow_image const &input, bool narrow)
+      -> std::pair<cv::Mat, std::optional<detail::narrow_image>> {
+        auto const whole = [&] {
+            auto result = execute(first, last, detail::widen(input, 0, input.data.rows));
+            if (narrow  &&  detail::narrowable(result))
+                return std::make_pair(cv::Mat(), std::make_optional(detail::narrow(result, precision_)));
+            return std::make_pair(std::move(result), std::optional<detail::narrow_image>());
+        };
+
+        int halo = 0;
+        for (auto stage=first; stage<last; ++stage)
+        {
+            if (!fn_[stage].local()  ||  fn_[stage].crop)
+                return whole();
+            halo += fn_[stage].halo.height;
+        }
+
+        cv::Mat                             wide;
+        std::optional<detail::narrow_image> narrowed;
+        auto const rows = input.data.rows;
+        auto const band = detail::band_rows(input, halo);
+        for (int y=0; y<rows; y+=band)
+        {
+            auto const end    = std::min(y + band, rows);
+            auto const top    = std::max(y - halo, 0);
+            auto const bottom = std::min(end + halo, rows);
+            auto const result = execute(first, last, detail::widen(input, top, bottom));
+
+            // a stage that changes the size of the image can't run in bands
+            if (result.rows != bottom - top  ||  result.cols != input.data.cols)
+                return whole();
+
+            auto const kept = result.rowRange(y - top, end - top);
+            if (narrow  &&  detail::narrowable(result))
+            {
+                if (!narrowed)
+                    narrowed = detail::narrow_buffer(rows, result.cols, result.type(), precision_);
+                detail::narrow_rows(kept, *narrowed, y);
+            }
+            else
+            {
+                if (wide.empty())
+                    wide.create(rows, result.cols, result.type());
+                auto dst = wide.rowRange(y, end);
+                kept.copyTo(dst);
+            }
+        }
+        return std::make_pair(std::move(wide), std::move(narrowed));
+    };
+
+    auto const baseline = detail::allocations().live_bytes;
+    auto const measure = [stats, baseline](size_t first, auto const &step) {
+        if (!stats)
+        {
+            step();
+            return;
+        }
+
+        detail::reset_allocation_peak();
+        auto const before = detail::allocations();
+        auto const start  = std::chrono::steady_clock::now();
+        step();
+        auto const time   = std::chrono::steady_clock::now() - start;
+        auto const after  = detail::allocations();
+        auto const peak   = after.peak_bytes > baseline? after.peak_bytes - baseline : 0;
+
+        auto &s = stats->stages[first];
+        ++s.runs;
+        s.time        += time;
+        s.allocations += after.allocations - before.allocations;
+        s.bytes       += after.bytes - before.bytes;
+        s.peak_bytes   = std::max(s.peak_bytes, peak);
+        if (peak > stats->peak_bytes)
+        {
+            stats->peak_bytes = peak;
+            stats->peak_stage = first;
+        }
+    };
+
+    // a floating point image between two stages is held here instead of
+    // in `image` when the pipeline narrows its intermediates. the last
+    // stage of a run, and so the result, is always at full precision
+    std::optional<detail::narrow_image> held;
+
+    size_t stage = 0;
+    auto const run_to = [this, &execute, &execute_narrowed, &measure, &held, &stage, &image](size_t end) {
+        while (stage < end)
+        {
+            auto last = stage + 1;
+            if (!fn_[stage].pointwise.empty())
+            {
+                while (last < end  &&  !fn_[last].pointwise.empty())
+                    ++last;
+            }
+
+            bool const narrow = precision_ != full_precision  &&  last < end;
+            measure(stage, [&] {
+                if (held)
+                {
+                    auto const input = std::move(*held);
+                    held.reset();
+                    std::tie(image, held) = execute_narrowed(stage, last, input, narrow);
+                }
+                else
+                {
+                    image = execute(stage, last, std::move(image));
+                    if (narrow  &&  detail::narrowable(image))
+                    {
+                        held = detail::narrow(image, precision_);
+                        image.release();
+                    }
+                }
+            });
+            stage = last;
+        }
+    };
+
+    for (auto const &crop : pushdown_)
+    {
+        run_to(crop.begin);
+
+        // run the stages up to the crop on a view of the region that it
+        // keeps, grown by their halo. the margin absorbs the border effects
+        // so the kept region is identical to cropping the whole result
+        auto const bounds = detail::bounds(image);
+        auto const rect   = crop.rect & bounds;
+        auto const region = rect.empty()? bounds : detail::grow(rect, crop.margin) & bounds;
+
+        image = image(region);
+        run_to(crop.end);
+        image = image(rect - region.tl());
+        ++stage;    // the crop itself
+    }
+
+    run_to(fn_.size());
+    return std::move(image);
 }
 
 // pipeline a persistent pipeline
@@ -34,12 +315,32 @@ persistent_pipeline operator|(delay_result, pipeline_fn_t rhs)
     return persistent_pipeline(std::move(rhs));
 }
 
+inline
+persistent_pipeline operator|(delay_result, pipeline_stage rhs)
+{
+    return persistent_pipeline(std::move(rhs));
+}
+
 inline
 persistent_pipeline operator|(delay_result, cv::Mat (*rhs)(cv::Mat const &))
 {
     return persistent_pipeline(rhs);
 }
 
+// set how the pipeline keeps floating point images between its stages
+// e.g. auto edges = pipeline | half_precision | convert(CV_32F) | sobel(1, 0) | gaussian_blur(5, 5);
+inline
+persistent_pipeline operator|(delay_result, intermediate_precision rhs)
+{
+    return persistent_pipeline().intermediates(rhs);
+}
+
+inline
+persistent_pipeline operator|(persistent_pipeline lhs, intermediate_precision rhs)
+{
+    return lhs.intermediates(rhs);
+}
+
 // run a persistent_pipeline
 inline
 cv::Mat operator|(cv::Mat lhs, persistent_pipeline const &rhs)
@@ -54,6 +355,12 @@ persistent_pipeline operator|(persistent_pipeline lhs, pipeline_fn_t rhs)
     return lhs.append(std::move(rhs));
 }
 
+inline
+persistent_pipeline operator|(persistent_pipeline lhs, pipeline_stage rhs)
+{
+    return lhs.append(std::move(rhs));
+}
+
 inline
 persistent_pipeline operator|(pipeline_fn_t lhs, persistent_pipeline rhs)
 {
@@ -66,6 +373,20 @@ persistent_pipeline operator|(persistent_pipeline lhs, cv::Mat (*rhs)(cv::Mat co
     return lhs.append(rhs);
 }
 
+// OpenCV functions that return an expression, such as cv::abs
+inline
+persistent_pipeline operator|(persistent_pipeline lhs, cv::MatExpr (*rhs)(cv::Mat const &))
+{
+    pipeline_stage stage([rhs](cv::Mat const &image) -> cv::Mat { return rhs(image); });
+    if (rhs == static_cast<cv::MatExpr (*)(cv::Mat const &)>(cv::abs))
+    {
+        stage.halo      = cv::Size();
+        stage.signature = detail::signature("abs");
+        stage.pointwise = { {detail::pointwise_op::abs} };
+    }
+    return lhs.append(std::move(stage));
+}
+
 inline
 persistent_pipeline operator|(cv::Mat (*lhs)(cv::Mat const &), persistent_pipeline rhs)
 {
@@ -88,6 +409,95 @@ foreach(C const &container, persistent_pipeline rhs)
         std::placeholders::_1, std::cref(container), rhs);
 }
 
+// run the pipeline concurrently on the sub-view of each rectangle in the
+// container, and fold the results into the image in order with `reduce`
+//    reduce: cv::Mat (cv::Mat image, int index, cv::Mat result)
+template<typename C, typename Reduce>
+inline
+pipeline_fn_t
+parallel_foreach(C const &rects, persistent_pipeline rhs, Reduce reduce)
+{
+    return parallel_foreach(
+        rects,
+        [rhs](cv::Mat const &image, int, cv::Rect const &rect) -> cv::Mat {
+            return rhs(image(rect & detail::bounds(image)));
+        },
+        reduce);
+}
+
+
+namespace detail {
+
+template<typename... Fns>
+struct tee_t
+{
+    std::tuple<Fns...> fns;
+};
+
+// run one branch of a tee on the shared input. persistent pipelines take
+// their input by value, so they are given another header on the same data
+template<typename Fn>
+auto run_branch(Fn const &fn, cv::Mat const &image)
+{
+    if constexpr (std::is_invocable_v<Fn const &, cv::Mat const &>)
+        return fn(image);
+    else
+        return fn(cv::Mat(image));
+}
+
+template<typename... Fns, size_t... I>
+auto run_tee(cv::Mat const &image, std::tuple<Fns...> const &fns, std::index_sequence<I...>)
+{
+    std::tuple<std::optional<std::decay_t<decltype(run_branch(std::get<I>(fns), image))>>...> results;
+    std::array<std::exception_ptr, sizeof...(I)> errors;
+    std::array<std::function<void ()>, sizeof...(I)> const branches = {
+        [&] { std::get<I>(results).emplace(run_branch(std::get<I>(fns), image)); }...
+    };
+
+    // a stripe per branch, so each can go to a different thread
+    cv::parallel_for_(
+        cv::Range(0, int(branches.size())),
+        [&branches, &errors](cv::Range const &range) {
+            for (int i=range.start; i<range.end; ++i)
+            {
+                try
+                {
+                    branches[i]();
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            }
+        },
+        double(branches.size()));
+
+    for (auto const &error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+    return std::make_tuple(std::move(*std::get<I>(results))...);
+}
+
+}   // namespace detail
+
+// feed one image to several pipelines or functions at once, on OpenCV's
+// thread pool, and collect their results in a tuple. the branches share
+// the input without copying it, so they must not modify it in place
+// e.g. auto [kps, preview] = image | tee(find_keypoints, pipeline | gaussian_blur(5, 5));
+template<typename... Fns>
+detail::tee_t<Fns...> tee(Fns... fns)
+{
+    return { std::make_tuple(std::move(fns)...) };
+}
+
+template<typename... Fns>
+auto operator|(cv::Mat const &image, detail::tee_t<Fns...> const &branches)
+{
+    return detail::run_tee(image, branches.fns, std::index_sequence_for<Fns...>());
+}
+
 
 // get a list files in a directory that match a wildcard
 inline
@@ -95,7 +505,7 @@ std::vector<std::filesystem::path>
 directory_iterator(std::filesystem::path pathname)
 {
     std::vector<cv::String> results;
-    cv::glob(pathname.u8string(), results, false);
+    cv::glob(detail::utf8(pathname), results, false);
 
     std::vector<std::filesystem::path> pathnames;
     for (auto const &result : results)
@@ -144,4 +554,312 @@ operator|(std::initializer_list<T> const &list,
 }
 
 
+// the outcome of one item of a batch run by try_each
+typedef
+enum { item_ok, item_load_failed, item_bad_image, item_stage_failed }
+item_status;
+
+struct batch_item
+{
+    item_status status = item_ok;
+    cv::Mat     result;
+    std::string error;      // what failed, for an item that did
+};
+
+struct batch_stats
+{
+    size_t items          = 0;
+    size_t ok             = 0;
+    size_t load_failures  = 0;
+    size_t bad_images     = 0;
+    size_t stage_failures = 0;
+    size_t skipped        = 0;  // already done, by a checkpointed run
+};
+
+struct batch_results
+{
+    std::vector<batch_item> items;  // in the order of the batch
+    batch_stats             stats;
+};
+
+namespace detail {
+
+struct try_each_t
+{
+    persistent_pipeline pipeline;
+};
+
+// an unreadable file or empty image is reported without throwing; only a
+// stage that throws costs an exception
+template<typename T>
+batch_item try_item(T const &item, persistent_pipeline const &pipeline)
+{
+    batch_item outcome;
+    cv::Mat image;
+    if constexpr (std::is_same<T, std::filesystem::path>::value)
+    {
+        image = load_image(item);
+        if (image.empty())
+        {
+            outcome.status = item_load_failed;
+            outcome.error  = detail::utf8(item);
+            return outcome;
+        }
+    }
+    else
+    {
+        if (item.empty())
+        {
+            outcome.status = item_bad_image;
+            outcome.error  = "bad_image";
+            return outcome;
+        }
+        image = item;
+    }
+
+    try
+    {
+        outcome.result = pipeline(std::move(image));
+    }
+    catch (exceptions::file_not_found const &e)
+    {
+        outcome.status = item_load_failed;
+        outcome.error  = e.what();
+    }
+    catch (exceptions::bad_image const &e)
+    {
+        outcome.status = item_bad_image;
+        outcome.error  = e.what();
+    }
+    catch (std::exception const &e)
+    {
+        outcome.status = item_stage_failed;
+        outcome.error  = e.what();
+    }
+    catch (...)
+    {
+        outcome.status = item_stage_failed;
+        outcome.error  = "unknown exception";
+    }
+    return outcome;
+}
+
+inline
+void count_item(batch_stats &stats, item_status status)
+{
+    ++stats.items;
+    switch (status)
+    {
+      case item_ok:           ++stats.ok;             break;
+      case item_load_failed:  ++stats.load_failures;  break;
+      case item_bad_image:    ++stats.bad_images;     break;
+      case item_stage_failed: ++stats.stage_failures; break;
+    }
+}
+
+template<typename It>
+batch_results try_items(It first, It last, persistent_pipeline const &pipeline)
+{
+    batch_results results;
+    for (; first != last; ++first)
+    {
+        results.items.push_back(try_item(*first, pipeline));
+        count_item(results.stats, results.items.back().status);
+    }
+    return results;
+}
+
+}   // namespace detail
+
+// run a pipeline over a batch of files or images without letting one bad
+// item abort the rest. each item gets its result or the reason it failed,
+// and the failures are counted by kind
+// e.g. auto results = directory_iterator("*.png") | try_each(pipeline | gray | equalizeHist);
+inline
+detail::try_each_t
+try_each(persistent_pipeline pipeline)
+{
+    return { std::move(pipeline) };
+}
+
+template<typename T>
+batch_results operator|(std::vector<T> const &items, detail::try_each_t const &batch)
+{
+    return detail::try_items(items.begin(), items.end(), batch.pipeline);
+}
+
+template<typename T, size_t N>
+batch_results operator|(std::array<T, N> const &items, detail::try_each_t const &batch)
+{
+    return detail::try_items(items.begin(), items.end(), batch.pipeline);
+}
+
+template<typename T>
+batch_results operator|(std::initializer_list<T> const &items, detail::try_each_t const &batch)
+{
+    return detail::try_items(items.begin(), items.end(), batch.pipeline);
+}
+
+
+namespace detail {
+
+// the merge of a reduce() that folds every result into one accumulator
+struct serial_merge
+{
+};
+
+template<typename Acc, typename Combine, typename Merge>
+struct reduce_t
+{
+    persistent_pipeline pipeline;
+    Acc                 init;
+    Combine             combine;
+    Merge               merge;
+};
+
+template<typename T>
+cv::Mat run_item(T const &item, persistent_pipeline const &pipeline)
+{
+    if constexpr (std::is_same<T, std::filesystem::path>::value)
+        return item | load | pipeline;
+    else
+        return item | pipeline;
+}
+
+// an accumulator of its own, so that combining into a cv::Mat in place
+// doesn't write to pixels shared with other accumulators
+template<typename Acc>
+Acc fresh(Acc const &init)
+{
+    if constexpr (std::is_same<Acc, cv::Mat>::value)
+        return init.clone();
+    else
+        return init;
+}
+
+// items sorted by cost are `interleaved` over the stripes, stripe s taking
+// items s, s + stripes, and so on, so each gets its share of the costly ones
+template<typename T, typename Acc, typename Combine, typename Merge>
+Acc run_reduce(T const *items, size_t count, reduce_t<Acc, Combine, Merge> const &reduction, bool interleaved=false)
+{
+    constexpr bool partial = !std::is_same<Merge, serial_merge>::value;
+
+    std::mutex                        mutex;
+    std::vector<std::pair<int, Acc>>  partials;     // by the first item or stripe folded into them
+    Acc                               shared = fresh(reduction.init);
+    std::exception_ptr                error;
+
+    // a few stripes a thread, so one slow item doesn't hold up the rest
+    auto const stripes = int(std::min(count, 4 * size_t(std::max(cv::getNumThreads(), 1))));
+    auto const each = [&](cv::Range const &range, auto const &visit) {
+        if (interleaved)
+        {
+            for (int stripe=range.start; stripe<range.end; ++stripe)
+            {
+                for (auto i=size_t(stripe); i<count; i+=stripes)
+                    visit(i);
+            }
+        }
+        else
+        {
+            for (int i=range.start; i<range.end; ++i)
+                visit(size_t(i));
+        }
+    };
+
+    cv::parallel_for_(
+        cv::Range(0, interleaved? stripes : int(count)),
+        [&](cv::Range const &range) {
+            try
+            {
+                if constexpr (partial)
+                {
+                    auto acc = fresh(reduction.init);
+                    each(range, [&](size_t i) {
+                        acc = reduction.combine(std::move(acc), run_item(items[i], reduction.pipeline));
+                    });
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    partials.emplace_back(range.start, std::move(acc));
+                }
+                else
+                {
+                    each(range, [&](size_t i) {
+                        auto const result = run_item(items[i], reduction.pipeline);
+                        std::lock_guard<std::mutex> lock(mutex);
+                        shared = reduction.combine(std::move(shared), result);
+                    });
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        },
+        stripes);
+
+    if (error)
+        std::rethrow_exception(error);
+
+    if constexpr (partial)
+    {
+        if (partials.empty())
+            return shared;
+
+        // stripes finish in any order, but are merged in the order of the
+        // items they start with, so the result is the same from run to run
+        std::sort(partials.begin(), partials.end(), [](auto const &a, auto const &b) {
+            return a.first < b.first;
+        });
+        auto result = std::move(partials.front().second);
+        for (size_t i=1; i<partials.size(); ++i)
+            result = reduction.merge(std::move(result), partials[i].second);
+        return result;
+    }
+    else
+        return shared;
+}
+
+}   // namespace detail
+
+// fold the results of a pipeline over a batch of files or images as they
+// are produced, so memory doesn't grow with the size of the batch. the
+// items are processed on OpenCV's thread pool; each stripe of them is
+// folded into its own copy of `init`, and the partial results are merged
+// at the end in the order of the items, so a merge that only associates,
+// such as appending, keeps them in order. `init` must be an identity of
+// `merge`
+//    combine: Acc (Acc acc, cv::Mat const &result)
+//    merge:   Acc (Acc acc, Acc const &partial)
+template<typename Acc, typename Combine, typename Merge>
+detail::reduce_t<Acc, Combine, Merge>
+reduce(persistent_pipeline pipeline, Acc init, Combine combine, Merge merge)
+{
+    return { std::move(pipeline), std::move(init), std::move(combine), std::move(merge) };
+}
+
+// without a merge, the results are combined into one accumulator one at
+// a time, in no particular order, while the pipeline runs in parallel
+template<typename Acc, typename Combine>
+detail::reduce_t<Acc, Combine, detail::serial_merge>
+reduce(persistent_pipeline pipeline, Acc init, Combine combine)
+{
+    return { std::move(pipeline), std::move(init), std::move(combine), detail::serial_merge() };
+}
+
+template<typename T, typename Acc, typename Combine, typename Merge>
+Acc operator|(std::vector<T> const &items, detail::reduce_t<Acc, Combine, Merge> const &reduction)
+{
+    return detail::run_reduce(items.data(), items.size(), reduction);
+}
+
+template<typename T, size_t N, typename Acc, typename Combine, typename Merge>
+Acc operator|(std::array<T, N> const &items, detail::reduce_t<Acc, Combine, Merge> const &reduction)
+{
+    return detail::run_reduce(items.data(), N, reduction);
+}
+
+
 }   // namespace opencv_pipeline
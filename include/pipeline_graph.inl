@@ -0,0 +1,199 @@
+#pragma once
+
+namespace opencv_pipeline {
+
+// the value carried along an edge of a pipeline_graph
+using graph_value = std::variant<cv::Mat, std::vector<cv::KeyPoint>>;
+
+// several pipelines over one image, as a graph of stages. a node is added
+// only once for each distinct stage applied to each distinct input, so a
+// prefix such as `gray | gaussian_blur(5, 5)` shared by the pipelines is
+// computed once. stages without a signature, e.g. lambdas, are never
+// shared, and crops are not moved upstream as in a persistent_pipeline
+// e.g. pipeline_graph graph;
+//      auto blurred = graph.add(graph.input(), pipeline | gray | gaussian_blur(5, 5));
+//      auto edges   = graph.add(blurred, pipeline | sobel(1, 0));
+//      auto kps     = graph.keypoints(blurred, "ORB");
+//      auto results = graph(image, {edges, kps});
+class pipeline_graph
+{
+  public:
+    using node = size_t;
+
+    pipeline_graph()
+    {
+        nodes_.push_back({ nullptr, {}, 0 });
+    }
+
+    // the image the graph is run on
+    node input() const
+    {
+        return 0;
+    }
+
+    // apply each stage of the pipeline in turn to the image at `from`
+    node add(node from, persistent_pipeline const &pipeline)
+    {
+        for (auto const &stage : pipeline.stages())
+            from = add(from, stage);
+        return from;
+    }
+
+    node add(node from, pipeline_stage stage)
+    {
+        auto const signature = stage.signature;
+        return insert(signature, { from }, [stage=std::move(stage)](inputs const &in) -> graph_value {
+            return stage(std::get<cv::Mat>(*in[0]));
+        });
+    }
+
+    // detect keypoints in the image at `image`
+    node keypoints(node image, std::string detector)
+    {
+        return insert(detail::signature("keypoints", detector), { image }, [detector](inputs const &in) -> graph_value {
+            std::vector<cv::KeyPoint> keypoints;
+            detail::detect_keypoints(detector, keypoints, std::get<cv::Mat>(*in[0]));
+            return keypoints;
+        });
+    }
+
+    // extract the descriptors of the keypoints at `keypoints` from the
+    // image at `image`
+    node descriptors(node image, node keypoints, std::string extractor)
+    {
+        return insert(detail::signature("descriptors", extractor), { image, keypoints }, [extractor](inputs const &in) -> graph_value {
+            return detail::extract_keypoints(extractor, std::get<std::vector<cv::KeyPoint>>(*in[1]), std::get<cv::Mat>(*in[0]));
+        });
+    }
+
+    size_t size() const
+    {
+        return nodes_.size();
+    }
+
+    // run the nodes the outputs depend on, level by level from the input.
+    // the nodes of each level are independent, and run in parallel on
+    // OpenCV's thread pool. each intermediate value is released as soon
+    // as the last node that consumes it has finished
+    std::vector<graph_value> operator()(cv::Mat image, std::vector<node> const &outputs) const
+    {
+        // inputs always precede their consumers, so one backward pass
+        // finds the nodes needed and counts their consumers
+        std::vector<bool> needed(nodes_.size());
+        std::unique_ptr<std::atomic<int>[]> consumers(new std::atomic<int>[nodes_.size()]);
+        for (size_t i=0; i<nodes_.size(); ++i)
+            consumers[i] = 0;
+        for (auto const output : outputs)
+        {
+            needed.at(output) = true;
+            ++consumers[output];    // held until the results are collected
+        }
+
+        std::vector<std::vector<node>> levels;
+        for (size_t i=nodes_.size(); i-- > 1; )
+        {
+            if (!needed[i])
+                continue;
+
+            auto const &n = nodes_[i];
+            levels.resize(std::max(levels.size(), n.level));
+            levels[n.level-1].push_back(i);
+            for (auto const in : n.inputs)
+            {
+                needed[in] = true;
+                ++consumers[in];
+            }
+        }
+
+        std::vector<std::optional<graph_value>> values(nodes_.size());
+        values[0] = std::move(image);
+
+        for (auto const &level : levels)
+        {
+            std::vector<std::exception_ptr> errors(level.size());
+            cv::parallel_for_(
+                cv::Range(0, int(level.size())),
+                [&](cv::Range const &range) {
+                    for (int i=range.start; i<range.end; ++i)
+                    {
+                        try
+                        {
+                            run(level[i], values, consumers.get());
+                        }
+                        catch (...)
+                        {
+                            errors[i] = std::current_exception();
+                        }
+                    }
+                },
+                double(level.size()));
+
+            for (auto const &error : errors)
+            {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        }
+
+        std::vector<graph_value> results;
+        for (auto const output : outputs)
+            results.push_back(*values[output]);
+        return results;
+    }
+
+  private:
+    using inputs = std::vector<graph_value const *>;
+
+    struct graph_node
+    {
+        std::function<graph_value (inputs const &)> fn;
+        std::vector<node>                           inputs;
+        size_t                                      level;  // longest path from the input
+    };
+
+    // the existing node with the same signature and inputs, or a new one
+    node insert(std::string const &signature, std::vector<node> in, std::function<graph_value (inputs const &)> fn)
+    {
+        size_t level = 0;
+        std::string key = signature;
+        for (auto const from : in)
+        {
+            level = std::max(level, nodes_.at(from).level);
+            key  += '@' + std::to_string(from);
+        }
+
+        if (!signature.empty())
+        {
+            auto const found = index_.find(key);
+            if (found != index_.end())
+                return found->second;
+        }
+
+        nodes_.push_back({ std::move(fn), std::move(in), level + 1 });
+        if (!signature.empty())
+            index_.emplace(key, nodes_.size() - 1);
+        return nodes_.size() - 1;
+    }
+
+    void run(node i, std::vector<std::optional<graph_value>> &values, std::atomic<int> *consumers) const
+    {
+        auto const &n = nodes_[i];
+
+        inputs in;
+        for (auto const from : n.inputs)
+            in.push_back(&*values[from]);
+        values[i] = n.fn(in);
+
+        // the last consumer of an input releases it
+        for (auto const from : n.inputs)
+        {
+            if (--consumers[from] == 0)
+                values[from].reset();
+        }
+    }
+
+    std::vector<graph_node>               nodes_;
+    std::unordered_map<std::string, node> index_;
+};
+
+}   // namespace opencv_pipeline
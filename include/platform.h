@@ -0,0 +1,31 @@
+#pragma once
+
+// the operating system interfaces behind shared memory, mapped video files
+// and journals. the parts of the library that use them include this, so
+// they still reach code that includes opencv_pipeline.h. windows.h is
+// included lean and without its min and max macros, and
+// WIN32_LEAN_AND_MEAN and NOMINMAX are left as the includer had them
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define OPENCV_PIPELINE_WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#define OPENCV_PIPELINE_NOMINMAX
+#endif
+#include <windows.h>
+#ifdef OPENCV_PIPELINE_NOMINMAX
+#undef NOMINMAX
+#undef OPENCV_PIPELINE_NOMINMAX
+#endif
+#ifdef OPENCV_PIPELINE_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef OPENCV_PIPELINE_WIN32_LEAN_AND_MEAN
+#endif
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
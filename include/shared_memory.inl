@@ -0,0 +1,397 @@
+#pragma once
+
+#include "platform.h"
+
+namespace opencv_pipeline {
+
+namespace detail {
+
+// a named block of shared memory, mapped read-write into this process
+class shared_memory_block
+{
+  public:
+    // create a block of `size` bytes, removed when the creator unmaps it
+    shared_memory_block(std::string const &name, size_t size) : owner_(true)
+    {
+#ifdef _WIN32
+        handle_ = CreateFileMappingA(
+            INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+            DWORD(uint64_t(size) >> 32), DWORD(size), name.c_str());
+        if (handle_  &&  GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            CloseHandle(handle_);
+            handle_ = nullptr;
+        }
+        if (!handle_)
+            throw std::runtime_error("Unable to create shared memory: " + name);
+        map(size);
+#else
+        name_ = posix_name(name);
+        auto const fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            throw std::runtime_error("Unable to create shared memory: " + name);
+        if (ftruncate(fd, off_t(size)) != 0)
+        {
+            ::close(fd);
+            shm_unlink(name_.c_str());
+            throw std::runtime_error("Unable to size shared memory: " + name);
+        }
+        map(fd, size);
+#endif
+    }
+
+    // attach to an existing block
+    explicit shared_memory_block(std::string const &name) : owner_(false)
+    {
+#ifdef _WIN32
+        handle_ = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        if (!handle_)
+            throw std::runtime_error("Unable to open shared memory: " + name);
+        map(0);
+#else
+        name_ = posix_name(name);
+        auto const fd = shm_open(name_.c_str(), O_RDWR, 0);
+        struct stat status;
+        if (fd < 0  ||  fstat(fd, &status) != 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            throw std::runtime_error("Unable to open shared memory: " + name);
+        }
+        map(fd, size_t(status.st_size));
+#endif
+    }
+
+    ~shared_memory_block()
+    {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        CloseHandle(handle_);
+#else
+        munmap(data_, size_);
+        if (owner_)
+            shm_unlink(name_.c_str());
+#endif
+    }
+
+    shared_memory_block(shared_memory_block const &)            = delete;
+    shared_memory_block &operator=(shared_memory_block const &) = delete;
+
+    uchar *data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+  private:
+#ifdef _WIN32
+    // a size of 0 maps the whole block
+    void map(size_t size)
+    {
+        data_ = static_cast<uchar *>(MapViewOfFile(handle_, FILE_MAP_ALL_ACCESS, 0, 0, size));
+        if (!data_)
+        {
+            CloseHandle(handle_);
+            throw std::runtime_error("Unable to map shared memory");
+        }
+
+        MEMORY_BASIC_INFORMATION info;
+        VirtualQuery(data_, &info, sizeof(info));
+        size_ = size? size : size_t(info.RegionSize);
+    }
+
+    HANDLE handle_ = nullptr;
+#else
+    static std::string posix_name(std::string const &name)
+    {
+        return name.empty()  ||  name[0] != '/'? '/' + name : name;
+    }
+
+    void map(int fd, size_t size)
+    {
+        auto const data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+        {
+            if (owner_)
+                shm_unlink(name_.c_str());
+            throw std::runtime_error("Unable to map shared memory: " + name_);
+        }
+        data_ = static_cast<uchar *>(data);
+        size_ = size;
+    }
+
+    std::string name_;
+#endif
+
+    bool const owner_;
+    uchar     *data_ = nullptr;
+    size_t     size_ = 0;
+};
+
+// the layout of a ring of raw frames in shared memory: this header, the
+// state of each slot, then `slots` slots of `slot_size` bytes, each
+// holding a frame of `height` rows of `stride` bytes
+struct shm_ring_header
+{
+    static constexpr uint32_t signature = 0x5256434f;  // "OCVR"
+
+    uint32_t              magic;
+    uint32_t              slots;
+    int32_t               width;
+    int32_t               height;
+    int32_t               type;
+    uint32_t              stride;
+    uint64_t              slot_size;
+    std::atomic<uint64_t> sequence;     // frames published; frame n is in slot n % slots
+    std::atomic<uint32_t> closed;       // no more frames will be published
+};
+
+// a slot is held by readers while they refer to the frame in it, and
+// the producer doesn't overwrite it in the meantime
+struct shm_ring_slot
+{
+    static constexpr uint64_t writing = ~uint64_t(0);
+
+    std::atomic<uint64_t> frame;        // the frame number it holds
+    std::atomic<uint32_t> readers;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free  &&  std::atomic<uint32_t>::is_always_lock_free,
+    "shared memory atomics must be lock free to work across processes");
+
+// the block is shared by processes that may be built differently, so the
+// offsets are fixed rather than left to the compiler
+struct shm_ring_layout
+{
+    shm_ring_layout(uint32_t slots, uint64_t slot_size)
+      : slot_states(cv::alignSize(sizeof(shm_ring_header), 64)),
+        frames(cv::alignSize(slot_states + slots * sizeof(shm_ring_slot), 64)),
+        size(frames + slots * slot_size)
+    {
+    }
+
+    size_t const slot_states;
+    size_t const frames;
+    size_t const size;
+};
+
+// a view of a ring in a block of shared memory
+class shm_ring
+{
+  public:
+    explicit shm_ring(std::unique_ptr<shared_memory_block> block)
+      : block_(std::move(block))
+    {
+    }
+
+    shm_ring_header &header() const
+    {
+        return *reinterpret_cast<shm_ring_header *>(block_->data());
+    }
+
+    shm_ring_slot &slot(uint64_t frame) const
+    {
+        auto const layout = shm_ring_layout(header().slots, header().slot_size);
+        return reinterpret_cast<shm_ring_slot *>(block_->data() + layout.slot_states)[frame % header().slots];
+    }
+
+    // the pixels of the slot for `frame`
+    cv::Mat frame(uint64_t frame) const
+    {
+        auto const &h      = header();
+        auto const  layout = shm_ring_layout(h.slots, h.slot_size);
+        return cv::Mat(h.height, h.width, h.type, block_->data() + layout.frames + (frame % h.slots) * h.slot_size, h.stride);
+    }
+
+    size_t size() const
+    {
+        return block_->size();
+    }
+
+  private:
+    std::unique_ptr<shared_memory_block> block_;
+};
+
+// reads the frames of a ring in order, skipping those overwritten before
+// they were read. each frame refers to the pixels in its slot, which are
+// held until the last reference to the frame is released
+class shm_ring_reader : public std::enable_shared_from_this<shm_ring_reader>
+{
+  public:
+    explicit shm_ring_reader(std::string const &name)
+      : ring_(std::make_unique<shared_memory_block>(name))
+    {
+        if (ring_.size() < sizeof(shm_ring_header)
+        ||  ring_.header().magic != shm_ring_header::signature
+        ||  ring_.size() < shm_ring_layout(ring_.header().slots, ring_.header().slot_size).size)
+        {
+            throw std::runtime_error("Not a shared memory frame ring: " + name);
+        }
+
+        // start from the oldest frame still in the ring
+        auto const published = ring_.header().sequence.load();
+        next_ = published > ring_.header().slots? published - ring_.header().slots : 0;
+    }
+
+    // the next frame, waiting for the producer to publish it, or an empty
+    // image once the producer has closed the ring
+    cv::Mat next()
+    {
+        auto &header = ring_.header();
+        while (1)
+        {
+            auto const closed    = header.closed.load();
+            auto const published = header.sequence.load();
+            if (next_ >= published)
+            {
+                if (closed)
+                    return cv::Mat();
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+                continue;
+            }
+
+            // claim the slot, then check that the frame is still in it. the
+            // producer marks a slot before checking for readers, so one of
+            // the two sees the other
+            next_ = std::max(next_, published > header.slots? published - header.slots : 0);
+            auto const frame = next_++;
+            auto &slot = ring_.slot(frame);
+            ++slot.readers;
+            if (slot.frame.load() == frame)
+                return wrap(frame);
+            --slot.readers;
+        }
+    }
+
+  private:
+    cv::Mat wrap(uint64_t frame);
+
+    shm_ring ring_;
+    uint64_t next_ = 0;
+};
+
+// the frame shares the slot's pixels, holding the slot until the last
+// reference to it is released
+inline
+cv::Mat shm_ring_reader::wrap(uint64_t frame)
+{
+    auto const slot = &ring_.slot(frame);
+    return external_mat(ring_.frame(frame), [reader = shared_from_this(), slot] {
+        --slot->readers;
+    });
+}
+
+}   // namespace detail
+
+// read frames from a shared memory ring written by a
+// shared_memory_producer, in this or another process, without copying them
+inline
+video_pipeline
+shared_memory(std::string const &name)
+{
+    try
+    {
+        auto const reader = std::make_shared<detail::shm_ring_reader>(name);
+        return video_pipeline([reader] { return reader->next(); }, std::string());
+    }
+    catch (std::exception const &e)
+    {
+        return video_pipeline(std::function<cv::Mat ()>(), e.what());
+    }
+}
+
+// writes frames into a shared memory ring for a video_pipeline to read
+// with shared_memory(name), e.g. in another process. a frame is copied
+// into the next slot that no reader holds, so a slow reader costs frames
+// rather than holding up the producer
+class shared_memory_producer
+{
+  public:
+    shared_memory_producer(std::string const &name, cv::Size size, int type, uint32_t slots=4)
+      : ring_(create(name, size, type, std::max(slots, 1u)))
+    {
+    }
+
+    // readers reach the end of the video once they have read the frames
+    // already published
+    ~shared_memory_producer()
+    {
+        close();
+    }
+
+    // false if every slot is held by a reader, and the frame is dropped
+    bool push(cv::Mat const &frame)
+    {
+        auto &header = ring_.header();
+        if (frame.cols != header.width  ||  frame.rows != header.height  ||  frame.type() != header.type)
+            throw std::invalid_argument("frame doesn't match the shared memory ring");
+
+        for (uint32_t i=0; i<header.slots; ++i)
+        {
+            auto const n = header.sequence.load();
+            auto &slot = ring_.slot(n);
+            auto const previous = slot.frame.load();
+            slot.frame.store(detail::shm_ring_slot::writing);
+            if (slot.readers.load() != 0)
+            {
+                // leave the held frame, and skip its number so readers
+                // find the slot doesn't hold it
+                slot.frame.store(previous);
+                header.sequence.store(n + 1);
+                continue;
+            }
+
+            auto target = ring_.frame(n);
+            frame.copyTo(target);
+            slot.frame.store(n);
+            header.sequence.store(n + 1);
+            return true;
+        }
+        return false;
+    }
+
+    void close()
+    {
+        ring_.header().closed.store(1);
+    }
+
+    // the number of frames published or skipped
+    uint64_t sequence() const
+    {
+        return ring_.header().sequence.load();
+    }
+
+  private:
+    static detail::shm_ring create(std::string const &name, cv::Size size, int type, uint32_t slots)
+    {
+        auto const stride    = cv::alignSize(size_t(size.width) * CV_ELEM_SIZE(type), 64);
+        auto const slot_size = cv::alignSize(stride * size_t(size.height), 64);
+        auto const layout    = detail::shm_ring_layout(slots, slot_size);
+        detail::shm_ring ring(std::make_unique<detail::shared_memory_block>(name, layout.size));
+
+        auto &header = *new (&ring.header()) detail::shm_ring_header{
+            0, slots, size.width, size.height, type, uint32_t(stride), slot_size, {0}, {0} };
+
+        // a new block is zero filled, so mark the slots as holding no
+        // frame before the header is marked valid
+        for (uint32_t i=0; i<slots; ++i)
+        {
+            auto &slot = ring.slot(i);
+            new (&slot.frame)   std::atomic<uint64_t>(detail::shm_ring_slot::writing);
+            new (&slot.readers) std::atomic<uint32_t>(0);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        header.magic = detail::shm_ring_header::signature;
+        return ring;
+    }
+
+    detail::shm_ring ring_;
+};
+
+}   // namespace opencv_pipeline
@@ -0,0 +1,241 @@
+#pragma once
+
+namespace opencv_pipeline {
+
+// what a bounded frame queue does with a frame when it is full
+typedef
+enum { block_when_full, drop_when_full }
+queue_full_policy;
+
+// the state of one stream run by a stream_scheduler
+struct stream_stats
+{
+    video_metrics metrics;          // of the stream's video_pipeline
+    size_t        queue_depth;      // frames captured and waiting to be processed
+    size_t        max_queue_depth;
+};
+
+// run many video streams on one fixed pool of worker threads, instead of
+// a thread per stream playing its own pipeline. each stream captures into
+// a bounded queue of frames; the workers take turns round-robin over the
+// streams, either processing a queued frame or capturing the next one.
+// frames of each stream are processed one at a time and in order
+class stream_scheduler
+{
+  public:
+    explicit stream_scheduler(unsigned threads=std::thread::hardware_concurrency())
+      : threads_(std::max(threads, 1u))
+    {
+    }
+
+    // add a stream of frames from `video` through `pipeline`. when
+    // `queue_size` frames are waiting, capture either waits or the oldest
+    // frame is dropped so processing keeps up with a live source
+    size_t add(
+        video_pipeline      &video,
+        persistent_pipeline  pipeline,
+        size_t               queue_size=2,
+        queue_full_policy    policy=drop_when_full)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.push_back(std::make_unique<stream>(video, std::move(pipeline), std::max<size_t>(queue_size, 1), policy));
+        return streams_.size() - 1;
+    }
+
+    // process all the streams until each reaches the end of its video, or
+    // a stage throws end_of_file. the first other exception thrown by a
+    // stream is rethrown once the remaining streams have finished
+    void run()
+    {
+        std::vector<std::thread> workers;
+        for (unsigned i=0; i<threads_; ++i)
+            workers.emplace_back([this] { work(); });
+        for (auto &worker : workers)
+            worker.join();
+
+        if (error_)
+            std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+
+    stream_stats stats(size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const &s = *streams_.at(index);
+        return { s.video.metrics(), s.frames.size(), s.max_queue_depth };
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return streams_.size();
+    }
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct stream
+    {
+        stream(video_pipeline &video, persistent_pipeline &&pipeline, size_t capacity, queue_full_policy policy)
+          : video(video), pipeline(std::move(pipeline)), capacity(capacity), policy(policy)
+        {
+        }
+
+        video_pipeline                                    &video;
+        persistent_pipeline const                          pipeline;
+        size_t const                                       capacity;
+        queue_full_policy const                            policy;
+        std::deque<std::pair<cv::Mat, clock::time_point>> frames;
+        size_t                                             max_queue_depth = 0;
+        bool                                               capturing       = false;
+        bool                                               processing      = false;
+        bool                                               ended           = false;
+    };
+
+    enum class task { none, capture, process };
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (1)
+        {
+            stream *s = nullptr;
+            auto const next = next_task(s);
+            if (next == task::capture)
+                capture(lock, *s);
+            else if (next == task::process)
+                process(lock, *s);
+            else if (finished())
+                break;
+            else
+                ready_.wait(lock);
+        }
+        ready_.notify_all();
+    }
+
+    // the next stream after the last one served that has work to do,
+    // preferring to drain a stream's queue over filling it
+    task next_task(stream *&s)
+    {
+        for (size_t i=0; i<streams_.size(); ++i)
+        {
+            s = streams_[(next_ + i) % streams_.size()].get();
+            auto const run = (!s->processing  &&  !s->frames.empty())? task::process
+                           : (!s->capturing  &&  !s->ended
+                              &&  (s->frames.size() < s->capacity  ||  s->policy == drop_when_full))? task::capture
+                           : task::none;
+            if (run != task::none)
+            {
+                next_ = (next_ + i + 1) % streams_.size();
+                return run;
+            }
+        }
+        return task::none;
+    }
+
+    bool finished() const
+    {
+        return std::all_of(streams_.begin(), streams_.end(), [](auto const &s) {
+            return s->ended  &&  !s->capturing  &&  !s->processing  &&  s->frames.empty();
+        });
+    }
+
+    void capture(std::unique_lock<std::mutex> &lock, stream &s)
+    {
+        s.capturing = true;
+        lock.unlock();
+
+        cv::Mat frame;
+        std::exception_ptr error;
+        try
+        {
+            frame = s.video.next_frame();
+        }
+        catch (exceptions::end_of_file &)
+        {
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        auto const captured_at = clock::now();
+
+        lock.lock();
+        s.capturing = false;
+        bool dropped = false;
+        if (frame.empty())
+            end(s, error);
+        else if (!s.ended)
+        {
+            if (s.frames.size() == s.capacity)
+            {
+                s.frames.pop_front();
+                dropped = true;
+            }
+            s.frames.emplace_back(std::move(frame), captured_at);
+            s.max_queue_depth = std::max(s.max_queue_depth, s.frames.size());
+        }
+        ready_.notify_all();
+
+        // reporting the drop may call the stream's report function, which
+        // mustn't hold up the other streams
+        if (dropped)
+        {
+            lock.unlock();
+            s.video.frame_dropped();
+            lock.lock();
+        }
+    }
+
+    void process(std::unique_lock<std::mutex> &lock, stream &s)
+    {
+        auto frame = std::move(s.frames.front());
+        s.frames.pop_front();
+        s.processing = true;
+        lock.unlock();
+
+        bool ended = false;
+        std::exception_ptr error;
+        try
+        {
+            s.pipeline(std::move(frame.first));
+            s.video.frame_done(frame.second);
+        }
+        catch (exceptions::frame_dropped &)
+        {
+            s.video.frame_dropped();
+        }
+        catch (exceptions::end_of_file &)
+        {
+            ended = true;
+        }
+        catch (...)
+        {
+            ended = true;
+            error = std::current_exception();
+        }
+
+        lock.lock();
+        s.processing = false;
+        if (ended)
+            end(s, error);
+        ready_.notify_all();
+    }
+
+    // stop a stream, discarding its queued frames
+    void end(stream &s, std::exception_ptr error)
+    {
+        s.ended = true;
+        s.frames.clear();
+        if (error  &&  !error_)
+            error_ = error;
+    }
+
+    unsigned const                       threads_;
+    mutable std::mutex                   mutex_;
+    std::condition_variable              ready_;
+    std::vector<std::unique_ptr<stream>> streams_;
+    size_t                               next_ = 0;
+    std::exception_ptr                   error_;
+};
+
+}   // namespace opencv_pipeline
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+namespace opencv_pipeline {
+
+namespace detail {
+
+// paths as UTF-8 in a std::string, which is what OpenCV and the journal
+// take. from C++20, u8string() returns std::u8string and u8path() is
+// deprecated, so the characters are copied across instead
+inline
+std::string utf8(std::filesystem::path const &pathname)
+{
+#ifdef __cpp_char8_t
+    auto const name = pathname.u8string();
+    return std::string(name.begin(), name.end());
+#else
+    return pathname.u8string();
+#endif
+}
+
+inline
+std::filesystem::path from_utf8(std::string const &name)
+{
+#ifdef __cpp_char8_t
+    return std::filesystem::path(std::u8string(name.begin(), name.end()));
+#else
+    return std::filesystem::u8path(name);
+#endif
+}
+
+}   // namespace detail
+
+}   // namespace opencv_pipeline
@@ -0,0 +1,217 @@
+#pragma once
+
+namespace opencv_pipeline {
+
+// the state of a record() sink
+struct record_stats
+{
+    using milliseconds = std::chrono::duration<double, std::milli>;
+
+    size_t       frames          = 0;   // given to the sink
+    size_t       written         = 0;   // encoded
+    size_t       dropped         = 0;   // discarded from a full queue
+    size_t       queue_depth     = 0;   // frames waiting to be encoded
+    size_t       max_queue_depth = 0;
+    milliseconds lag_p50;               // from being queued to being
+    milliseconds lag_p95;               // encoded, over the most recent
+    milliseconds lag_max;               // frames
+};
+
+namespace detail {
+
+// encodes frames on a thread of its own, fed through a bounded queue
+class async_video_writer
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    async_video_writer(std::filesystem::path pathname, int fourcc, double fps, size_t capacity, queue_full_policy policy)
+      : pathname_(std::move(pathname)), fourcc_(fourcc), fps_(fps), capacity_(std::max<size_t>(capacity, 1)), policy_(policy),
+        thread_([this] { run(); })
+    {
+    }
+
+    ~async_video_writer()
+    {
+        close();
+    }
+
+    async_video_writer(async_video_writer const &)            = delete;
+    async_video_writer &operator=(async_video_writer const &) = delete;
+
+    // queue a frame, waiting for room or dropping the oldest queued frame
+    // when the queue is full. an error from the encoder is rethrown here
+    void push(cv::Mat const &frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (policy_ == block_when_full)
+            space_.wait(lock, [this] { return queue_.size() < capacity_  ||  error_  ||  closing_; });
+        if (error_)
+            std::rethrow_exception(error_);
+        if (closing_)
+            throw std::logic_error("frame recorded after the recording was closed");
+
+        ++stats_.frames;
+        if (queue_.size() == capacity_)
+        {
+            queue_.pop_front();
+            ++stats_.dropped;
+        }
+        queue_.emplace_back(frame, clock::now());
+        stats_.max_queue_depth = std::max(stats_.max_queue_depth, queue_.size());
+        ready_.notify_one();
+    }
+
+    // encode the frames still queued, and finish the file
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        ready_.notify_all();
+        space_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    record_stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto stats = stats_;
+        stats.queue_depth = queue_.size();
+        if (!lags_.values().empty())
+        {
+            auto sorted = lags_.values();
+            auto percentile = [&sorted](double p) -> record_stats::milliseconds {
+                auto const nth = sorted.begin() + size_t(p * (sorted.size() - 1));
+                std::nth_element(sorted.begin(), nth, sorted.end());
+                return *nth;
+            };
+            stats.lag_p50 = percentile(0.50);
+            stats.lag_p95 = percentile(0.95);
+            stats.lag_max = percentile(1.00);
+        }
+        return stats;
+    }
+
+  private:
+    void run()
+    {
+        cv::VideoWriter writer;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (1)
+        {
+            ready_.wait(lock, [this] { return !queue_.empty()  ||  closing_; });
+            if (queue_.empty())
+                break;
+
+            auto const frame = std::move(queue_.front());
+            queue_.pop_front();
+            space_.notify_one();
+            lock.unlock();
+
+            std::exception_ptr error;
+            try
+            {
+                // the frame size and colour are only known from the first frame
+                if (!writer.isOpened()
+                &&  !writer.open(detail::utf8(pathname_), fourcc_, fps_, frame.first.size(), frame.first.channels() != 1))
+                {
+                    throw std::runtime_error("Unable to open video writer: " + detail::utf8(pathname_));
+                }
+                writer.write(frame.first);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            auto const lag = clock::now() - frame.second;
+
+            lock.lock();
+            if (error)
+            {
+                error_ = error;
+                queue_.clear();
+                space_.notify_all();
+                break;
+            }
+
+            ++stats_.written;
+            lags_.add(lag);
+        }
+        lock.unlock();
+        writer.release();
+    }
+
+    std::filesystem::path const                        pathname_;
+    int const                                          fourcc_;
+    double const                                       fps_;
+    size_t const                                       capacity_;
+    queue_full_policy const                            policy_;
+    mutable std::mutex                                 mutex_;
+    std::condition_variable                            ready_;
+    std::condition_variable                            space_;
+    std::deque<std::pair<cv::Mat, clock::time_point>> queue_;
+    bool                                               closing_ = false;
+    std::exception_ptr                                 error_;
+    record_stats                                       stats_;
+    recent_values<record_stats::milliseconds, 1024>    lags_;
+    std::thread                                        thread_;     // last, to start once the rest is ready
+};
+
+}   // namespace detail
+
+// a sink that encodes the frames of a pipeline to a video file on a
+// thread of its own, so encoding doesn't hold up the pipeline. the file
+// is finished by close(), or once the last copy of the sink has gone
+class record_sink
+{
+  public:
+    record_sink(std::filesystem::path pathname, int fourcc, double fps, size_t queue_size, queue_full_policy policy)
+      : writer_(std::make_shared<detail::async_video_writer>(std::move(pathname), fourcc, fps, queue_size, policy))
+    {
+    }
+
+    // the frame is queued without copying it, so the pipeline mustn't
+    // overwrite it afterwards
+    cv::Mat operator()(cv::Mat const &frame) const
+    {
+        writer_->push(frame);
+        return frame;
+    }
+
+    record_stats stats() const
+    {
+        return writer_->stats();
+    }
+
+    void close()
+    {
+        writer_->close();
+    }
+
+  private:
+    std::shared_ptr<detail::async_video_writer> writer_;
+};
+
+// record frames to a video file with cv::VideoWriter, through a queue of
+// `queue_size` frames to an encoder thread. when the queue is full the
+// pipeline either waits for the encoder or the oldest queued frame is
+// dropped
+// e.g. auto rec = record("out.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30.);
+//      cam | gray_bgr | rec | play;
+//      rec.close();
+inline
+record_sink
+record(
+    std::filesystem::path pathname,
+    int                   fourcc,
+    double                fps,
+    size_t                queue_size=8,
+    queue_full_policy     policy=block_when_full)
+{
+    return record_sink(std::move(pathname), fourcc, fps, queue_size, policy);
+}
+
+}   // namespace opencv_pipeline
@@ -64,6 +64,317 @@ void detect_features()
     }
 }
 
+void keypoint_budget()
+{
+    using namespace opencv_pipeline;
+
+    auto const img = test_file | load | gray;
+    auto const all = img | keypoints("FAST") | end;
+
+    // a budget shared over a grid bounds the keypoints described
+    auto const kept = img | keypoints("FAST") | limit(100, cv::Size(4, 4)) | end;
+    assert(kept.size() == std::min<size_t>(all.size(), 100));
+    assert((img | keypoints("FAST") | limit(100, cv::Size(4, 4)) | descriptors("ORB")).rows == int(kept.size()));
+
+    // one cell keeps the strongest
+    auto const strongest = all | limit(10);
+    auto const weakest   = std::min_element(strongest.begin(), strongest.end(), [](auto const &a, auto const &b) {
+        return a.response < b.response;
+    });
+    assert(strongest.size() == std::min<size_t>(all.size(), 10));
+    assert(std::count_if(all.begin(), all.end(), [&weakest](auto const &kp) { return kp.response > weakest->response; }) < 10);
+
+    assert((all | limit(50, cv::Size(2, 2), true)).size() == std::min<size_t>(all.size(), 50));
+
+    // with more cells than the budget, the cells with the strongest go first
+    std::vector<cv::KeyPoint> const corners = {
+        { cv::Point2f(0.f, 0.f), 7.f, -1.f, 1.f }, { cv::Point2f(1.f, 1.f), 7.f, -1.f, 1.f },
+        { cv::Point2f(10.f, 0.f), 7.f, -1.f, 2.f }, { cv::Point2f(0.f, 10.f), 7.f, -1.f, 3.f },
+        { cv::Point2f(10.f, 10.f), 7.f, -1.f, 5.f }
+    };
+    auto const sparse = corners | limit(2, cv::Size(2, 2));
+    assert(sparse.size() == 2  &&  sparse[0].response == 3.f  &&  sparse[1].response == 5.f);
+}
+
+void detect_and_compute()
+{
+    using namespace opencv_pipeline;
+
+    auto const img = test_file | load | gray;
+
+    // a detector and extractor of the same algorithm run as one call, with
+    // the same descriptors as extracting from the detected keypoints
+    auto const kps      = img | keypoints("ORB") | end;
+    auto const separate = img | kps | descriptors("ORB");
+    auto const fused    = img | keypoints("ORB") | descriptors("ORB");
+    assert(fused.size() == separate.size());
+    assert(cv::norm(fused, separate, cv::NORM_INF) == 0.);
+
+    // the keypoints read afterwards are those described
+    auto detector = img | keypoints("BRISK");
+    auto const described = detector | descriptors("BRISK");
+    std::vector<cv::KeyPoint> const brisk = detector;
+    assert(int(brisk.size()) == described.rows);
+
+    // different algorithms still detect, then extract
+    assert((img | keypoints("FAST") | descriptors("ORB")).rows == int((img | keypoints("FAST") | end).size()));
+}
+
+void walk_directories()
+{
+    using namespace opencv_pipeline;
+
+    // a recursive pattern finds the test image below the data directory
+    auto const all = walk(TESTDATA_DIR "**/*.jpg").paths();
+    assert(std::any_of(all.begin(), all.end(), [](auto const &path) {
+        return std::filesystem::equivalent(path, test_file);
+    }));
+    assert(walk(TESTDATA_DIR "images/monalisa.jp?").paths().size() == 1);
+    assert(walk(TESTDATA_DIR "**/*.no-such-extension").paths().empty());
+
+    // the shards split the files between them, whatever the walk's order.
+    // a temporary walk set up in the loop lives as long as the loop
+    static_assert(std::is_same<decltype(walk(".").shard(0, 1)), walk>::value, "a temporary walk is set up by value");
+    size_t sharded = 0;
+    for (size_t i=0; i<3; ++i)
+    {
+        for (auto const &path : walk(TESTDATA_DIR "**/*.jpg").shard(i, 3))
+        {
+            assert(std::find(all.begin(), all.end(), path) != all.end());
+            ++sharded;
+        }
+    }
+    assert(sharded == all.size());
+
+    // the largest images come first, and the files are processed as found
+    auto const ordered = walk(TESTDATA_DIR "**/*.jpg").largest_first().paths();
+    assert(ordered.size() == all.size());
+    for (size_t i=1; i<ordered.size(); ++i)
+        assert(detail::probe_cost(ordered[i-1]) >= detail::probe_cost(ordered[i]));
+
+    // and are dealt out across the stripes of a reduction, each once
+    auto const reduced = walk(TESTDATA_DIR "**/*.jpg").largest_first() | reduce(
+        pipeline | gray,
+        size_t(0),
+        [](size_t acc, cv::Mat const &) { return acc + 1; },
+        [](size_t acc, size_t partial) { return acc + partial; });
+    assert(reduced == all.size());
+    assert((walk(test_file) | (pipeline | gray)).size() == 1);
+}
+
+void tolerant_batch()
+{
+    using namespace opencv_pipeline;
+
+    // a missing file doesn't stop the files after it
+    std::vector<std::filesystem::path> const files = { test_file, "missing.png", test_file };
+    auto const processed = files | try_each(pipeline | gray | mirror);
+    assert(processed.items.size() == 3);
+    assert(processed.items[0].status == item_ok  &&  processed.items[2].status == item_ok);
+    assert(cv::norm(processed.items[2].result, test_file | load | gray | mirror, cv::NORM_INF) == 0.);
+    assert(processed.items[1].status == item_load_failed  &&  processed.items[1].result.empty());
+    assert(processed.stats.items == 3  &&  processed.stats.ok == 2  &&  processed.stats.load_failures == 1);
+
+    // nor does an empty image, or a stage that throws
+    auto const colour = test_file | load;
+    auto const checked = std::vector<cv::Mat>{ colour, cv::Mat(), colour | gray } | try_each(pipeline | gray);
+    assert(checked.items[0].status == item_ok);
+    assert(checked.items[1].status == item_bad_image);
+    assert(checked.items[2].status == item_stage_failed  &&  !checked.items[2].error.empty());
+    assert(checked.stats.ok == 1  &&  checked.stats.bad_images == 1  &&  checked.stats.stage_failures == 1);
+}
+
+void checkpoint_resume()
+{
+    using namespace opencv_pipeline;
+
+    auto const dir = std::filesystem::temp_directory_path() / "opencv_pipeline_journal";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    auto const log_file = dir / "run.journal";
+    auto const output   = [dir](std::filesystem::path const &input) { return dir / (detail::utf8(input.stem()) + ".png"); };
+
+    std::vector<std::filesystem::path> const files = { test_file, "missing.png" };
+    auto const grey = pipeline | gray;
+    {
+        journal log(log_file);
+        auto const stats = files | checkpoint(log, grey, output);
+        assert(stats.ok == 1  &&  stats.load_failures == 1  &&  stats.skipped == 0);
+        assert(cv::norm(load_image(output(test_file), cv::IMREAD_GRAYSCALE), test_file | load | gray, cv::NORM_INF) == 0.);
+    }
+
+    // after a restart, the completed file is skipped and the failed one retried
+    {
+        journal log(log_file);
+        assert(log.size() == 1);
+        auto const stats = files | checkpoint(log, grey, output);
+        assert(stats.items == 2  &&  stats.skipped == 1  &&  stats.ok == 0  &&  stats.load_failures == 1);
+
+        // another pipeline has its own records
+        assert((files | checkpoint(log, grey | mirror, output)).ok == 1);
+        assert(log.size() == 2);
+    }
+
+    // a lost output is made again, and a record cut short is ignored
+    std::filesystem::remove(output(test_file));
+    std::ofstream(log_file, std::ios::binary | std::ios::app) << "partial\trecord";
+    {
+        journal log(log_file);
+        assert(log.size() == 2);
+        assert((files | checkpoint(log, grey, output)).ok == 1);
+    }
+    assert(journal(log_file).size() == 2);
+
+    // so is one left empty, as by a crash before it reached the disk
+    std::ofstream(output(test_file), std::ios::binary | std::ios::trunc);
+    {
+        journal log(log_file);
+        assert((files | checkpoint(log, grey, output)).ok == 1);
+        assert(std::filesystem::file_size(output(test_file)) > 0);
+    }
+
+    // a pipeline with a lambda in it is only checkpointed under a version
+    pipeline_fn_t const identity = [](cv::Mat const &image) { return image; };
+    auto const custom = pipeline | gray | identity;
+    bool refused = false;
+    try
+    {
+        journal log(log_file);
+        files | checkpoint(log, custom, output);
+    }
+    catch (std::invalid_argument const &)
+    {
+        refused = true;
+    }
+    assert(refused);
+    {
+        journal log(log_file);
+        assert((files | checkpoint(log, custom, output, "v1")).ok == 1);
+        assert((files | checkpoint(log, custom, output, "v1")).skipped == 1);
+        assert((files | checkpoint(log, custom, output, "v2")).ok == 1);
+    }
+
+    // an operand is known by its pixels, not where they happen to be, so a
+    // restart that loads the same background again still skips the work
+    auto const background = [] { cv::Mat image = test_file | load | gray; return cv::Mat(image / 2); };
+    {
+        journal log(log_file);
+        assert((files | checkpoint(log, pipeline | gray | subtract(background()), output)).ok == 1);
+    }
+    {
+        journal log(log_file);
+        assert((files | checkpoint(log, pipeline | gray | subtract(background()), output)).skipped == 1);
+        assert((files | checkpoint(log, pipeline | gray | subtract(background() + 1), output)).ok == 1);
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+#ifdef OPENCV_PIPELINE_COROUTINES
+opencv_pipeline::task<cv::Mat> load_and_process(std::filesystem::path pathname, opencv_pipeline::persistent_pipeline const &pipe)
+{
+    using namespace opencv_pipeline;
+    auto image = co_await async_load(pathname);
+    co_return co_await async_run(pipe, std::move(image));
+}
+
+opencv_pipeline::task<std::vector<cv::Mat>> read_frames(opencv_pipeline::video_pipeline &video, int count)
+{
+    using namespace opencv_pipeline;
+    std::vector<cv::Mat> frames;
+    for (int i=0; i<count; ++i)
+        frames.push_back(co_await async_read(video));
+    co_return frames;
+}
+
+void coroutine_batch()
+{
+    using namespace opencv_pipeline;
+
+    // many images in flight at once on the shared executors
+    auto const pipe = pipeline | gray | mirror;
+    std::vector<task<cv::Mat>> tasks;
+    for (int i=0; i<64; ++i)
+        tasks.push_back(load_and_process(test_file, pipe));
+    auto const results  = sync_wait(when_all(std::move(tasks)));
+    auto const expected = test_file | load | pipe;
+    assert(results.size() == 64);
+    for (auto const &result : results)
+        assert(cv::norm(result, expected, cv::NORM_INF) == 0.);
+
+    // a failure reaches the awaiting code
+    bool thrown = false;
+    try
+    {
+        sync_wait(load_and_process("missing.png", pipe));
+    }
+    catch (exceptions::file_not_found const &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // frames read one after another come in the order the video has them
+    auto vid       = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+    auto reference = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+    auto const frames = sync_wait(read_frames(vid, 3));
+    assert(frames.size() == 3);
+    for (auto const &frame : frames)
+        assert(cv::norm(frame, reference.next_frame(), cv::NORM_INF) == 0.);
+}
+#endif
+
+void dataset_reduction()
+{
+    using namespace opencv_pipeline;
+
+    // a mean image, summed in per-stripe partials
+    auto const sum = [](cv::Mat acc, cv::Mat const &image) -> cv::Mat {
+        if (acc.empty())
+            return image.clone();
+        acc += image;
+        return acc;
+    };
+
+    std::vector<std::filesystem::path> const files(6, test_file);
+    auto const total = files | reduce(pipeline | convert(CV_32FC3), cv::Mat(), sum, sum);
+    cv::Mat expected;
+    (test_file | load).convertTo(expected, CV_32FC3);
+    assert(cv::norm(total / double(files.size()), expected, cv::NORM_INF) < 1e-3);
+
+    // the range of gray levels, combined one result at a time
+    auto const range = files | reduce(
+        pipeline | gray,
+        std::make_pair(255., 0.),
+        [](std::pair<double, double> acc, cv::Mat const &image) {
+            double lo, hi;
+            cv::minMaxLoc(image, &lo, &hi);
+            return std::make_pair(std::min(acc.first, lo), std::max(acc.second, hi));
+        });
+    double lo, hi;
+    cv::minMaxLoc(test_file | load | gray, &lo, &hi);
+    assert(range.first == lo  &&  range.second == hi);
+
+    // images reduce as well as files, and an empty batch is its init
+    std::vector<cv::Mat> const images(3, test_file | load);
+    assert(cv::norm(images | reduce(pipeline | convert(CV_32FC3), cv::Mat(), sum, sum), expected * 3., cv::NORM_INF) < 1e-3);
+    assert((std::vector<cv::Mat>() | reduce(pipeline | gray, 7, [](int acc, cv::Mat const &) { return acc; })) == 7);
+
+    // partials are merged in the order of the items, whichever stripe
+    // finishes first
+    std::vector<cv::Mat> numbered;
+    for (int i=0; i<100; ++i)
+        numbered.push_back(cv::Mat(1, 1, CV_32SC1, cv::Scalar(i)));
+    auto const sequence = numbered | reduce(
+        pipeline | mirror,
+        std::vector<int>(),
+        [](std::vector<int> acc, cv::Mat const &image) { acc.push_back(image.at<int>(0)); return acc; },
+        [](std::vector<int> acc, std::vector<int> const &partial) { acc.insert(acc.end(), partial.begin(), partial.end()); return acc; });
+    assert(sequence.size() == numbered.size());
+    for (int i=0; i<100; ++i)
+        assert(sequence[i] == i);
+}
+
 void file_processing()
 {
     using namespace opencv_pipeline;
@@ -153,6 +464,617 @@ void play_grey_video()
     cvDestroyAllWindows();
 }
 
+void adaptive_resolution()
+{
+    using namespace opencv_pipeline;
+    auto vid = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+    auto const full = vid.next_frame().size();
+
+    // an unachievable frame budget drives the scale down to its floor
+    vid.adapt_resolution(std::chrono::microseconds(1), 0.5);
+    cv::Size size;
+    vid | [&size](cv::Mat const &frame) -> cv::Mat {
+            size = frame.size();
+            return frame;
+        }
+        | play;
+
+    assert(vid.scale() == 0.5);
+    assert(size == cv::Size(cvRound(full.width * 0.5), cvRound(full.height * 0.5)));
+    auto const mapped = vid.to_full_resolution(cv::Rect(cv::Point(), size)).size();
+    assert(std::abs(mapped.width - full.width) <= 1  &&  std::abs(mapped.height - full.height) <= 1);
+}
+
+void playback_metrics()
+{
+    using namespace opencv_pipeline;
+    auto vid = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+
+    size_t reports = 0;
+    vid.report(std::chrono::seconds(0), [&reports](video_metrics const &metrics) {
+        assert(metrics.processed + metrics.dropped <= metrics.captured);
+        ++reports;
+    });
+
+    // drop every other frame
+    bool odd = false;
+    vid | gray
+        | [&odd](cv::Mat const &frame) -> cv::Mat {
+            odd = !odd;
+            if (odd)
+                throw exceptions::frame_dropped();
+            return frame;
+        }
+        | play;
+
+    auto const metrics = vid.metrics();
+    assert(metrics.captured > 0);
+    assert(metrics.processed + metrics.dropped == metrics.captured);
+    assert(metrics.dropped == (metrics.captured + 1) / 2);
+    assert(reports == metrics.captured);
+    assert(metrics.fps > 0.);
+    assert(metrics.latency_p50 <= metrics.latency_p95  &&  metrics.latency_p95 <= metrics.latency_p99);
+
+    // percentiles are over the most recent frames, the oldest replaced first
+    detail::recent_values<int, 4> recent;
+    for (int i=1; i<=6; ++i)
+        recent.add(i);
+    auto values = recent.values();
+    std::sort(values.begin(), values.end());
+    assert((values == std::vector<int>{ 3, 4, 5, 6 }));
+}
+
+void allocator_nesting()
+{
+    using namespace opencv_pipeline;
+    auto const standard = cv::Mat::getDefaultAllocator();
+
+    // an arena created while accounting, which stops first, delegates to
+    // the allocator beneath accounting from then on
+    detail::account_allocations(true);
+    auto arena = std::make_unique<detail::frame_arena>(size_t(1) << 20);
+    detail::account_allocations(false);
+
+    auto const before = detail::allocations().allocations;
+    cv::Mat const image(64, 64, CV_8U, cv::Scalar(1));
+    assert(detail::allocations().allocations == before);
+
+    arena.reset();
+    assert(cv::Mat::getDefaultAllocator() == standard);
+}
+
+void arena_playback()
+{
+    using namespace opencv_pipeline;
+    auto vid = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+    vid.use_arena(size_t(16) << 20);
+
+    // keeping a frame past the sink moves the arena on to a new region,
+    // so the frames played after it don't overwrite it
+    cv::Mat kept;
+    size_t frames = 0;
+    vid | gray
+        | gaussian_blur(5, 5)
+        | [&kept, &frames](cv::Mat const &frame) -> cv::Mat {
+            if (frames++ == 1)
+                kept = frame;
+            return frame;
+        }
+        | play;
+    assert(frames > 2);
+
+    auto reference = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+    reference.next_frame();
+    assert(cv::norm(kept, reference.next_frame() | gray | gaussian_blur(5, 5), cv::NORM_INF) == 0.);
+}
+
+void shared_memory_ring()
+{
+    using namespace opencv_pipeline;
+
+    auto const src = test_file | load;
+    std::vector<cv::Mat> const frames = { src, src | mirror, src | gray_bgr };
+
+    // a name of its own, so test runs at the same time don't share a ring
+#ifdef _WIN32
+    auto const name = "opencv_pipeline_test_" + std::to_string(GetCurrentProcessId());
+#else
+    auto const name = "opencv_pipeline_test_" + std::to_string(getpid());
+#endif
+    shared_memory_producer producer(name, src.size(), src.type(), 4);
+    auto ring = shared_memory(name);
+    assert(ring.open());
+    for (auto const &frame : frames)
+        assert(producer.push(frame));
+
+    // frames refer to their slot in the ring, which the producer skips
+    // while the frame is held
+    auto const first = ring.next_frame();
+    assert(cv::norm(first, frames[0], cv::NORM_INF) == 0.);
+    for (int i=0; i<4; ++i)
+        assert(producer.push(frames[i % 3]));
+    assert(cv::norm(first, frames[0], cv::NORM_INF) == 0.);
+
+    // the reader has fallen a ring behind, so resumes at the oldest frame
+    // still in it. the slot it holds was skipped
+    producer.close();
+    std::vector<cv::Mat> received;
+    ring | [&received](cv::Mat const &frame) -> cv::Mat {
+            received.push_back(frame.clone());
+            return frame;
+        }
+        | play;
+    assert(received.size() == 3);
+    assert(cv::norm(received[0], frames[1], cv::NORM_INF) == 0.);
+
+    assert(!shared_memory("opencv_pipeline_missing").open());
+}
+
+void mapped_replay()
+{
+    using namespace opencv_pipeline;
+
+    auto const dir = std::filesystem::temp_directory_path() / "opencv_pipeline_mapped";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    auto const raw_file = dir / "frames.raw";
+    auto const y4m_file = dir / "frames.y4m";
+
+    // 4:2:0 frames have even dimensions
+    auto const loaded = test_file | load;
+    auto const src    = loaded | crop(cv::Rect(0, 0, loaded.cols & ~1, loaded.rows & ~1));
+    std::vector<cv::Mat> const frames = { src, src | mirror, src | gray_bgr };
+    for (auto const &pathname : { raw_file, y4m_file })
+    {
+        auto const record = record_frames(pathname, 25.);
+        for (auto const &frame : frames)
+            record(frame);
+    }
+
+    {
+        // frames are read in any order
+        mapped_video const raw(raw_file);
+        assert(raw.size() == frames.size());
+        assert(raw.fps() == 25.);
+        assert(cv::norm(raw[2], frames[2], cv::NORM_INF) == 0.);
+        assert(cv::norm(raw[0], frames[0], cv::NORM_INF) == 0.);
+
+        // drawing into a frame leaves the file as it was
+        auto frame = raw[0];
+        frame(cv::Rect(0, 0, 16, 16)).setTo(cv::Scalar(0, 0, 255));
+        assert(cv::norm(mapped_video(raw_file)[0], frames[0], cv::NORM_INF) == 0.);
+
+        mapped_video const y4m(y4m_file);
+        assert(y4m.size() == frames.size());
+        assert(y4m.fps() == 25.);
+        cv::Mat i420;
+        cv::cvtColor(frames[1], i420, cv::COLOR_BGR2YUV_I420);
+        assert(cv::norm(y4m[1], i420, cv::NORM_INF) == 0.);
+    }
+
+    {
+        size_t count = 0;
+        auto vid = replay(raw_file, 1);
+        vid | [&frames, &count](cv::Mat const &frame) -> cv::Mat {
+                assert(cv::norm(frame, frames[1 + count], cv::NORM_INF) == 0.);
+                ++count;
+                return frame;
+            }
+            | play;
+        assert(count == 2);
+    }
+
+    // headers that don't describe frames this can read are refused
+    auto const refused = [](std::filesystem::path const &pathname) {
+        try
+        {
+            mapped_video const video(pathname);
+        }
+        catch (std::runtime_error const &)
+        {
+            return true;
+        }
+        return false;
+    };
+    auto const deep_file = dir / "deep.y4m";
+    std::ofstream(deep_file, std::ios::binary) << "YUV4MPEG2 W4 H4 F25:1 C420p10\nFRAME\n" << std::string(48, '\0');
+    assert(refused(deep_file));
+
+    auto const bad_file = dir / "bad.raw";
+    std::filesystem::copy_file(raw_file, bad_file);
+    {
+        std::fstream file(bad_file, std::ios::binary | std::ios::in | std::ios::out);
+        int32_t const type = -1;
+        file.seekp(offsetof(detail::raw_video_header, type));
+        file.write(reinterpret_cast<char const *>(&type), sizeof(type));
+    }
+    assert(refused(bad_file));
+
+    std::filesystem::remove_all(dir);
+}
+
+void async_recording()
+{
+    using namespace opencv_pipeline;
+    auto vid = video(TESTDATA_DIR "videos/originals/frame_counter.3gp");
+    auto const pathname = std::filesystem::temp_directory_path() / "opencv_pipeline_recorded.avi";
+
+    auto rec = record(pathname, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 25., 4, block_when_full);
+    vid | rec | play;
+    rec.close();
+
+    auto const stats = rec.stats();
+    assert(stats.frames > 0);
+    assert(stats.written == stats.frames  &&  stats.dropped == 0);
+    assert(stats.queue_depth == 0  &&  stats.max_queue_depth <= 4);
+    assert(stats.lag_p50 <= stats.lag_p95  &&  stats.lag_p95 <= stats.lag_max);
+
+    size_t frames = 0;
+    {
+        auto recorded = video(pathname);
+        recorded | [&frames](cv::Mat const &frame) -> cv::Mat {
+                ++frames;
+                return frame;
+            }
+            | play;
+    }
+    assert(frames == stats.written);
+
+    std::filesystem::remove(pathname);
+}
+
+void scheduled_streams()
+{
+    using namespace opencv_pipeline;
+    auto const filename = TESTDATA_DIR "videos/originals/frame_counter.3gp";
+
+    // several streams share two worker threads; queued frames wait for
+    // processing rather than being dropped, so every frame is processed
+    std::vector<std::unique_ptr<video_pipeline>> videos;
+    stream_scheduler scheduler(2);
+    for (int i=0; i<4; ++i)
+    {
+        videos.push_back(std::make_unique<video_pipeline>(std::filesystem::path(filename)));
+        scheduler.add(*videos.back(), pipeline | gray | gaussian_blur(5, 5), 4, block_when_full);
+    }
+    scheduler.run();
+
+    for (size_t i=0; i<scheduler.size(); ++i)
+    {
+        auto const stats = scheduler.stats(i);
+        assert(stats.metrics.captured > 0);
+        assert(stats.metrics.processed == stats.metrics.captured);
+        assert(stats.metrics.dropped == 0);
+        assert(stats.queue_depth == 0  &&  stats.max_queue_depth <= 4);
+    }
+}
+
+void change_gated_processing()
+{
+    using namespace opencv_pipeline;
+
+    int runs = 0;
+    auto const expensive = if_changed(2., [&runs](cv::Mat const &image) -> cv::Mat {
+        ++runs;
+        return image | gray | gaussian_blur(5, 5);
+    });
+
+    auto const frame = test_file | load;
+    cv::Mat noisy = frame.clone();
+    noisy(cv::Rect(0, 0, 4, 4)).setTo(cv::Scalar::all(255));
+    auto const changed = frame | mirror;
+
+    auto const first = frame | expensive;
+    auto const again = noisy | expensive;   // a few pixels differ
+    assert(runs == 1);
+    assert(cv::norm(first, again, cv::NORM_INF) == 0.);
+
+    auto const other = changed | expensive;
+    assert(runs == 2);
+    assert(cv::norm(other, changed | gray | gaussian_blur(5, 5), cv::NORM_INF) == 0.);
+
+    // threads sharing the stage take turns, so the result of the one that
+    // runs it is what the others re-emit
+    std::vector<cv::Mat>     results(4);
+    std::vector<std::thread> threads;
+    for (auto &result : results)
+        threads.emplace_back([&] { result = frame | expensive; });
+    for (auto &thread : threads)
+        thread.join();
+    for (auto const &result : results)
+        assert(cv::norm(result, first, cv::NORM_INF) == 0.);
+    assert(runs == 3);
+}
+
+void parallel_regions()
+{
+    using namespace opencv_pipeline;
+
+    auto const src = test_file | load | gray;
+    std::vector<cv::Rect> rects;
+    for (int y=0; y+32<=src.rows; y+=32)
+        rects.emplace_back(0, y, src.cols, 32);
+
+    // per-item results are combined in container order
+    std::vector<double> means;
+    auto const result = src
+        | parallel_foreach(
+            rects,
+            [](cv::Mat const &image, int, cv::Rect const &rect) {
+                return cv::mean(image(rect))[0];
+            },
+            [&means](cv::Mat image, int index, double mean) {
+                assert(index == int(means.size()));
+                means.push_back(mean);
+                return image;
+            });
+    assert(means.size() == rects.size());
+    for (size_t i=0; i<rects.size(); ++i)
+        assert(means[i] == cv::mean(src(rects[i]))[0]);
+    assert(result.data == src.data);
+
+    // a pipeline runs on the sub-view of each rectangle
+    cv::Mat blurred = cv::Mat::zeros(src.size(), src.type());
+    src | parallel_foreach(
+            rects,
+            pipeline | gaussian_blur(5, 5),
+            [&blurred, &rects](cv::Mat image, int index, cv::Mat region) {
+                region.copyTo(blurred(rects[index]));
+                return image;
+            });
+    assert(cv::norm(blurred(rects[1]), src(rects[1]) | gaussian_blur(5, 5), cv::NORM_INF) == 0.);
+}
+
+void fan_out()
+{
+    using namespace opencv_pipeline;
+
+    auto const src = test_file | load;
+    auto [kps, preview, mask] = src
+        | tee(
+            [](cv::Mat const &image) { return image | keypoints("ORB") | end; },
+            pipeline | gaussian_blur(5, 5),
+            pipeline | gray | threshold(0., 255.));
+    static_assert(std::is_same<std::vector<cv::KeyPoint>, decltype(kps)>::value);
+    static_assert(std::is_same<cv::Mat, decltype(preview)>::value);
+    static_assert(std::is_same<cv::Mat, decltype(mask)>::value);
+
+    assert(kps.size() == (src | keypoints("ORB") | end).size());
+    assert(cv::norm(preview, src | gaussian_blur(5, 5), cv::NORM_INF) == 0.);
+    assert(cv::norm(mask, src | gray | threshold(0., 255.), cv::NORM_INF) == 0.);
+}
+
+void shared_prefix_graph()
+{
+    using namespace opencv_pipeline;
+
+    auto const blurred = pipeline | gray | gaussian_blur(5, 5);
+    auto const invert  = [](cv::Mat const &image) -> cv::Mat { cv::Mat dst; cv::bitwise_not(image, dst); return dst; };
+
+    pipeline_graph graph;
+    auto const edges    = graph.add(graph.input(), blurred | sobel(1, 0));
+    auto const mask     = graph.add(graph.input(), blurred | threshold(0., 255.));
+    auto const kps      = graph.keypoints(graph.add(graph.input(), blurred), "ORB");
+    auto const features = graph.descriptors(graph.input(), kps, "ORB");
+    assert(graph.size() == 7);  // input, gray, gaussian_blur, sobel, threshold, keypoints, descriptors
+
+    // stages without a signature are never merged
+    assert(graph.add(edges, pipeline_fn_t(invert)) != graph.add(edges, pipeline_fn_t(invert)));
+
+    auto const src     = test_file | load;
+    auto const results = graph(src, { edges, mask, kps, features });
+    assert(cv::norm(std::get<cv::Mat>(results[0]), src | gray | gaussian_blur(5, 5) | sobel(1, 0), cv::NORM_INF) == 0.);
+    assert(cv::norm(std::get<cv::Mat>(results[1]), src | gray | gaussian_blur(5, 5) | threshold(0., 255.), cv::NORM_INF) == 0.);
+
+    auto const &keypoints = std::get<std::vector<cv::KeyPoint>>(results[2]);
+    assert(keypoints.size() == (src | gray | gaussian_blur(5, 5) | opencv_pipeline::keypoints("ORB") | end).size());
+    assert(std::get<cv::Mat>(results[3]).rows == int(keypoints.size()));
+}
+
+void in_place_stages()
+{
+    using namespace opencv_pipeline;
+
+    auto const src      = test_file | load | gray;
+    auto const expected = src | threshold(128., 255., cv::THRESH_BINARY) | mirror;
+
+    // a temporary that nothing else refers to is overwritten
+    auto image = src.clone();
+    auto const data   = image.data;
+    auto const result = std::move(image) | threshold(128., 255., cv::THRESH_BINARY) | mirror;
+    assert(result.data == data);
+    assert(cv::norm(result, expected, cv::NORM_INF) == 0.);
+
+    // a shared one is not
+    auto shared = src.clone();
+    auto const copy = shared;
+    assert((std::move(shared) | threshold(128., 255., cv::THRESH_BINARY)).data != copy.data);
+    assert(cv::norm(copy, src, cv::NORM_INF) == 0.);
+
+    // nor is the input to a persistent pipeline, unless it is handed over
+    auto const equalize = pipeline | convert(CV_8S) | convert(CV_8U) | equalizeHist;
+    auto input = src.clone();
+    auto const input_data = input.data;
+    auto const equalized  = src | equalize;
+    assert(cv::norm(src, input, cv::NORM_INF) == 0.);
+    assert((std::move(input) | equalize).data == input_data);
+    assert(cv::norm(src.clone() | equalize, equalized, cv::NORM_INF) == 0.);
+}
+
+void fused_pointwise()
+{
+    using namespace opencv_pipeline;
+
+    auto const src        = test_file | load;
+    auto const background = src | gaussian_blur(15, 15) | gray;
+
+    // each fused chain must equal its stages run one at a time
+    auto const unfused = [](cv::Mat image, persistent_pipeline const &pipe) {
+        for (auto const &stage : pipe.stages())
+            image = stage(image);
+        return image;
+    };
+
+    auto const motion = pipeline | gray | subtract(background) | cv::abs | threshold(20., 255., cv::THRESH_BINARY);
+    auto const mask   = src | motion;
+    assert(mask.type() == CV_8UC1);
+    assert(cv::norm(mask, unfused(src, motion), cv::NORM_INF) == 0.);
+
+    // an Otsu threshold of the chain's intermediate values
+    auto const otsu = pipeline | gray | convert(CV_32F, 0.5, 10.) | convert(CV_8U) | threshold(0., 255., cv::THRESH_BINARY | cv::THRESH_OTSU);
+    assert(cv::norm(src | otsu, unfused(src, otsu), cv::NORM_INF) == 0.);
+
+    // saturation between depths, and a table lookup
+    cv::Mat table(1, 256, CV_16S);
+    for (int i=0; i<256; ++i)
+        table.at<short>(i) = short(1000 - 9*i);
+    auto const depths = pipeline | gray_bgr | lut(table) | convert(CV_32F, 0.25, -3.) | threshold(100., 0., cv::THRESH_TRUNC) | convert(CV_8S);
+    assert(cv::norm(src | depths, unfused(src, depths), cv::NORM_INF) == 0.);
+
+    // an intermediate that nothing else refers to is overwritten
+    auto input = src.clone();
+    auto const data = input.data;
+    assert((std::move(input) | (pipeline | convert(CV_8U, 2.) | threshold(100., 255., cv::THRESH_TOZERO))).data == data);
+}
+
+void large_kernel_morphology()
+{
+    using namespace opencv_pipeline;
+
+    auto const src = test_file | load;
+    auto const reference = [](cv::Mat const &image, int shape, cv::Size size, bool dilating) {
+        cv::Mat dst;
+        auto const kernel = cv::getStructuringElement(shape, size);
+        if (dilating)
+            cv::dilate(image, dst, kernel);
+        else
+            cv::erode(image, dst, kernel);
+        return dst;
+    };
+
+    // large rectangles take the constant time path, and must agree with
+    // OpenCV at the borders and for kernels of even size
+    for (auto const &image : { src, src | gray, src | convert(CV_32F, 1./255) })
+    {
+        assert(cv::norm(image | dilate(31, 31), reference(image, cv::MORPH_RECT, cv::Size(31, 31), true), cv::NORM_INF) == 0.);
+        assert(cv::norm(image | erode(40, 15),  reference(image, cv::MORPH_RECT, cv::Size(40, 15), false), cv::NORM_INF) == 0.);
+        assert(cv::norm(image | dilate(1, 64),  reference(image, cv::MORPH_RECT, cv::Size(1, 64), true), cv::NORM_INF) == 0.);
+    }
+
+    // a view reads the pixels around it, as OpenCV does, and the identity
+    // only beyond the whole image
+    auto const view = src(cv::Rect(40, 30, 200, 150));
+    assert(cv::norm(view | dilate(31, 31), reference(view, cv::MORPH_RECT, cv::Size(31, 31), true), cv::NORM_INF) == 0.);
+    auto const edge = src(cv::Rect(0, 10, 120, src.rows - 10));
+    assert(cv::norm(edge | erode(40, 15), reference(edge, cv::MORPH_RECT, cv::Size(40, 15), false), cv::NORM_INF) == 0.);
+
+    // other shapes use the element the stage built
+    auto const grey = src | gray;
+    assert(cv::norm(grey | erode(21, 21, cv::MORPH_ELLIPSE), reference(grey, cv::MORPH_ELLIPSE, cv::Size(21, 21), false), cv::NORM_INF) == 0.);
+    assert(cv::norm(grey | dilate(9, 9, cv::MORPH_CROSS), reference(grey, cv::MORPH_CROSS, cv::Size(9, 9), true), cv::NORM_INF) == 0.);
+}
+
+void shared_pyramid()
+{
+    using namespace opencv_pipeline;
+
+    auto const grey = test_file | load | gray;
+    auto const pyr  = grey | pyramid(4);
+    assert(pyr.levels.size() == 4  &&  pyr.levels[0].data == grey.data);
+    assert(pyr.levels[3].size() == cv::Size(cvRound(grey.cols / 8.), cvRound(grey.rows / 8.)));
+
+    // a shrinking resize starts from the smallest level at least the size
+    // of the result, a half for .3. resampling twice differs a little from
+    // resampling once: on photographs by less than INTER_LINEAR differs
+    // from INTER_AREA, which is well over 30dB PSNR
+    auto const shrunk = pyr  | resize(.3, .3, cv::INTER_AREA);
+    auto const direct = grey | resize(.3, .3, cv::INTER_AREA);
+    assert(shrunk.size() == direct.size());
+    assert(cv::PSNR(shrunk, direct) >= 30.);
+
+    // other stages run on the image itself
+    auto const thresholded = pyr | threshold(128., 255., cv::THRESH_BINARY);
+    assert(cv::norm(thresholded, grey | threshold(128., 255., cv::THRESH_BINARY), cv::NORM_INF) == 0.);
+
+#if CV_MAJOR_VERSION==3
+    // ORB detects on the levels. at a scale other than its own, a keypoint
+    // keeps octave 0 and is described on the level it was found on
+    auto detector = pyr | keypoints("ORB");
+    auto const described = detector | descriptors("ORB");
+    std::vector<cv::KeyPoint> const kps = detector;
+    assert(!kps.empty()  &&  described.rows == int(kps.size())  &&  detector.levels.size() == kps.size());
+    assert(std::any_of(detector.levels.begin(), detector.levels.end(), [](int level) { return level > 0; }));
+    for (size_t i=0; i<kps.size(); ++i)
+    {
+        auto const level_scale = 1. / std::pow(2., detector.levels[i]);
+        auto kp = kps[i];
+        assert(kp.octave == 0);
+        kp.pt   = kp.pt * level_scale;
+        kp.size = float(kp.size * level_scale);
+        auto const on_level = pyr.levels[detector.levels[i]] | std::vector<cv::KeyPoint>{ kp } | descriptors("ORB");
+        assert(cv::norm(described.row(int(i)), on_level, cv::NORM_INF) == 0.);
+    }
+
+    // at ORB's scale of 1.2 the octaves are the levels, which ORB's own
+    // pyramid has too
+    auto orb = grey | pyramid(4, 1.2) | keypoints("ORB");
+    auto const orb_described = orb | descriptors("ORB");
+    std::vector<cv::KeyPoint> const orb_kps = orb;
+    for (size_t i=0; i<orb_kps.size(); ++i)
+        assert(orb_kps[i].octave == orb.levels[i]);
+    assert(cv::norm(orb_described, grey | orb_kps | descriptors("ORB"), cv::NORM_INF) == 0.);
+#endif
+}
+
+void reduced_precision()
+{
+    using namespace opencv_pipeline;
+
+    auto const src       = test_file | load | gray;
+    auto const full      = pipeline | convert(CV_32F, 1./255) | sobel(1, 0) | gaussian_blur(5, 5);
+    auto const reference = src | full;
+
+    auto const error = [&](intermediate_precision precision) {
+        auto narrowed = full;
+        auto const result = src | narrowed.intermediates(precision);
+        assert(result.type() == reference.type()  &&  result.size() == reference.size());
+        return cv::norm(result, reference, cv::NORM_INF);
+    };
+
+    // a stage passes on the error of its narrowed input times the sum of
+    // the magnitudes of its kernel, 8 for a 3x3 Sobel and 1 for a Gaussian,
+    // and adds that of narrowing its own result. convert's results lie in
+    // [0, 1] and Sobel's in [-4, 4]
+    assert(error(full_precision) == 0.);
+    assert(error(half_precision)    <= (8. * 1. + 4.) / 2048.  + 1e-5);
+    assert(error(fixed16_precision) <= (8. * 1. + 4.) / 65534. + 1e-5);
+}
+
+void allocation_accounting()
+{
+    using namespace opencv_pipeline;
+
+    auto const src  = test_file | load;
+    auto const pipe = pipeline | gray | gaussian_blur(5, 5) | threshold(128., 255., cv::THRESH_BINARY);
+
+    pipeline_stats stats;
+    auto const result = pipe(src.clone(), stats);
+    pipe(src.clone(), stats);
+    assert(cv::norm(result, src | pipe, cv::NORM_INF) == 0.);
+
+    assert(stats.stages.size() == 3);
+    assert(stats.stages[0].name == "gray()");
+    assert(stats.stages[0].runs == 2);
+    assert(stats.stages[0].allocations >= 2);
+    assert(stats.stages[0].bytes >= 2 * src.total());
+
+    // the blur works in 64-bit floating point, and threshold in place
+    assert(stats.stages[1].peak_bytes >= src.total() * sizeof(double));
+    assert(stats.stages[2].allocations == 0);
+    assert(stats.peak_stage == 1);
+    assert(stats.peak_bytes == stats.stages[1].peak_bytes);
+}
+
 
 // http://rnd.azoft.com/instant-license-plate-recognition-in-ios-apps/
 cv::Mat preprocess_license_plate(cv::Mat const &src)
@@ -228,7 +1150,7 @@ void license_plate()
 
         // step 7
         contours.clear();
-        findContours(src(rect.boundingRect() & roi(src)) | threshold(0., 255.), contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
+        findContours(src | crop(rect.boundingRect()) | threshold(0., 255.), contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
 
         double largest = 0.;
         size_t index = std::numeric_limits<size_t>::max();
@@ -253,7 +1175,7 @@ void license_plate()
             cv::Point2f vertices[4];
             box.points(vertices);
 
-            cv::Mat area = result(rect.boundingRect() & roi(result));
+            cv::Mat area = result | crop(rect.boundingRect());
             for (int i = 0; i < 4; ++i)
             {
                 line(area, vertices[i], vertices[(i + 1) % 4], cv::Scalar(255, 255, 0));
@@ -262,6 +1184,39 @@ void license_plate()
     }
 }
 
+void crop_pushdown()
+{
+    using namespace opencv_pipeline;
+
+    auto const src  = test_file | load;
+    auto const rect = cv::Rect(40, 60, 120, 80);
+
+    // the crop is moved upstream so the blur and closing only process the
+    // region they need, but the result is the same as cropping afterwards
+    auto const closing  = pipeline | gray | gaussian_blur(5, 5) | dilate(3, 9) | erode(3, 9);
+    auto const cropped  = src | (closing | crop(rect));
+    auto const expected = (src | closing)(rect);
+    assert(cropped.size() == rect.size());
+    assert(cv::norm(cropped, expected, cv::NORM_INF) == 0.);
+
+    // a region overlapping the image border is clipped
+    auto const corner = cv::Rect(-20, -20, 60, 60);
+    auto const clipped = src | (closing | crop(corner));
+    assert(clipped.size() == cv::Size(40, 40));
+    assert(cv::norm(clipped, (src | closing)(corner & roi(src)), cv::NORM_INF) == 0.);
+
+    // an automatic threshold needs the whole image, so the crop stays put
+    auto const otsu = pipeline | gray | threshold(0., 255.) | crop(rect);
+    assert(cv::norm(src | otsu, (src | gray | threshold(0., 255.))(rect), cv::NORM_INF) == 0.);
+
+    // nor can it move above a conversion from subsampled YUV, whose planes
+    // don't line up with the pixels they make
+    auto const yuv = src(cv::Rect(0, 0, src.cols & ~1, src.rows & ~1)) | color_space(cv::COLOR_BGR2YUV_I420);
+    auto const bgr = yuv | (pipeline | color_space(cv::COLOR_YUV2BGR_I420) | crop(rect));
+    assert(bgr.size() == rect.size());
+    assert(cv::norm(bgr, (yuv | color_space(cv::COLOR_YUV2BGR_I420))(rect), cv::NORM_INF) == 0.);
+}
+
 void exhaustive()
 {
     using namespace opencv_pipeline;
@@ -287,19 +1242,47 @@ void exhaustive()
 #endif
 
     // loading an image
-    auto img = cv::imread(test_file.u8string()) | load | mirror;
+    auto img = cv::imread(detail::utf8(test_file)) | load | mirror;
     img = img | gray_bgr;
     img = load_image(test_file) | gray_bgr | mirror;
     img = test_file | load | gray_bgr | mirror;
     static_assert(std::is_same<cv::Mat, decltype(img)>::value);
 
+    crop_pushdown();
+    change_gated_processing();
+    parallel_regions();
+    fan_out();
+    shared_prefix_graph();
+    in_place_stages();
+    fused_pointwise();
+    large_kernel_morphology();
+    shared_pyramid();
+    reduced_precision();
+    allocation_accounting();
     list_processing();
     file_processing();
+    walk_directories();
+    tolerant_batch();
+    checkpoint_resume();
+#ifdef OPENCV_PIPELINE_COROUTINES
+    coroutine_batch();
+#endif
+    dataset_reduction();
     pipelines_without_assignment();
     detect_features();
+    detect_and_compute();
+    keypoint_budget();
     reuse_pipeline();
 
     play_grey_video();
+    adaptive_resolution();
+    playback_metrics();
+    scheduled_streams();
+    allocator_nesting();
+    arena_playback();
+    shared_memory_ring();
+    mapped_replay();
+    async_recording();
 }
 
 }   // anonymous namespace